@@ -11,19 +11,13 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 TARGET = SphereFlake
 TEMPLATE = app
 
-INCLUDEPATH += $$PWD/glm
+include(sphereflake.pri)
 
 SOURCES += main.cpp\
     mainwindow.cpp \
     glwidget.cpp \
-    camera.cpp \
-    raytraycer.cpp \
-    scenedata.cpp \
+    renderthread.cpp
 
 HEADERS  += mainwindow.h \
     glwidget.h \
-    asyncrunner.h \
-    camera.h \
-    raytracer.h \
-    scenedata.h \
-    settings.h
+    renderthread.h
@@ -1,34 +1,44 @@
 #ifndef ASYNCRUNNER_H
 #define ASYNCRUNNER_H
 
-#include <future>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
-namespace MyRaytracer 
+#include "cancellationtoken.h"
+#include "threadpool.h"
+
+namespace MyRaytracer
 {
     // Runs tasks on a range of assigments in parallel.
     // For example if we have 20x30 pixels and calculation of every pixel requires some computations then on a multi-core machine
     // we can run 8 tasks in parallel (one task per core) and every task can work on a range of 75 pixels.
+    // The tasks are executed by a shared ThreadPool, so no threads are created while running.
     // The run method is asynchronous and will wait until all assignments are processed.
     // This class is not designed for multi-thread usage.
     template <typename Task>
     class AsyncRunner
     {
     public:
-        AsyncRunner(const Task &task) : task_(task) {
+        AsyncRunner(const Task &task, ThreadPool &threadPool) :
+            task_(task), threadPool_(threadPool), pendingTasks_(0), nextAssignment_(0) {
         }
 
         // Runs the task on all cores and waits for all instances to finish
         void run(unsigned int totalAssignments) {
-            unsigned int parallelTasksCount = std::thread::hardware_concurrency();
-            if (totalAssignments < std::thread::hardware_concurrency())
-                parallelTasksCount = totalAssignments;
+            if (totalAssignments == 0)
+                return;
+
+            // A few tasks per worker so that the idle workers have something to steal
+            unsigned int parallelTasksCount = std::min(totalAssignments, threadPool_.getThreadsCount() * kTasksPerThread);
 
             unsigned int assignmentsPerTask = totalAssignments / parallelTasksCount;
             if (assignmentsPerTask * parallelTasksCount < totalAssignments) {
                 assignmentsPerTask++;
             }
 
+            pendingTasks_ = parallelTasksCount;
             for (unsigned int taskIdx = 0; taskIdx < parallelTasksCount; taskIdx++) {
                 unsigned int taskAssignmentStartIdx = taskIdx * assignmentsPerTask;
                 unsigned int taskAssignmentEndIdx = (taskIdx + 1) * assignmentsPerTask - 1;
@@ -38,22 +48,76 @@ namespace MyRaytracer
                     taskAssignmentEndIdx = totalAssignments - 1;
                 }
                 if (taskAssignmentStartIdx <= taskAssignmentEndIdx) {
-                    runningTasks_.push(std::async(task_, taskAssignmentStartIdx, taskAssignmentEndIdx));
+                    threadPool_.submit([this, taskAssignmentStartIdx, taskAssignmentEndIdx] {
+                        task_(taskAssignmentStartIdx, taskAssignmentEndIdx);
+                        taskFinished();
+                    });
+                } else {
+                    taskFinished();
                 }
             }
 
-            
-            // Wait for the parallel tasks to finish
-            while (!runningTasks_.empty()) {
-                runningTasks_.front().wait();
-                runningTasks_.pop();
+            waitForTasks();
+        }
+
+        // Runs the task on all cores, but instead of splitting the assignments in fixed ranges upfront
+        // every task instance takes the next free assignment as soon as it is done with the previous one.
+        // This is better when the assignments differ a lot in cost. Waits for all instances to finish.
+        // If a cancellation token is passed the tasks stop taking assignments once it's cancelled.
+        // Returns false if it was cancelled, some of the assignments might be left unprocessed then.
+        bool runDynamic(unsigned int totalAssignments, const CancellationToken *cancellationToken = nullptr) {
+            if (totalAssignments == 0)
+                return true;
+
+            unsigned int parallelTasksCount = std::min(totalAssignments, threadPool_.getThreadsCount());
+
+            nextAssignment_ = 0;
+            pendingTasks_ = parallelTasksCount;
+            for (unsigned int taskIdx = 0; taskIdx < parallelTasksCount; taskIdx++) {
+                threadPool_.submit([this, totalAssignments, cancellationToken] {
+                    unsigned int assignmentIdx;
+                    while (!(cancellationToken && cancellationToken->isCancelled()) &&
+                           (assignmentIdx = nextAssignment_++) < totalAssignments) {
+                        task_(assignmentIdx, assignmentIdx);
+                    }
+                    taskFinished();
+                });
             }
+
+            waitForTasks();
+
+            return !(cancellationToken && cancellationToken->isCancelled());
         }
 
     private:
+        static const unsigned int kTasksPerThread = 4;
+
+        // The counter is changed under the lock so that the waiting thread can't
+        // return (and destroy us) while a finishing task is still touching the runner
+        void taskFinished() {
+            std::lock_guard<std::mutex> lock(doneMutex_);
+            if (--pendingTasks_ == 0)
+                doneCondition_.notify_all();
+        }
+
+        // Helps the pool while there is something to do and sleeps otherwise
+        void waitForTasks() {
+            while (pendingTasks_ > 0) {
+                if (!threadPool_.runPendingJob()) {
+                    std::unique_lock<std::mutex> lock(doneMutex_);
+                    doneCondition_.wait(lock, [this] { return pendingTasks_ == 0; });
+                }
+            }
+            std::lock_guard<std::mutex> lock(doneMutex_);
+        }
+
         Task task_;
+        ThreadPool &threadPool_;
 
-        std::queue<std::future<void>> runningTasks_;
+        std::atomic<unsigned int> pendingTasks_;
+        std::atomic<unsigned int> nextAssignment_;
+        std::mutex doneMutex_;
+        std::condition_variable doneCondition_;
     };
 }
 
@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# Benchmarks of building the scene, tracing rays and rendering frames
+#
+#-------------------------------------------------
+
+QT       += core
+
+TARGET = sphereflake-bench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../sphereflake.pri)
+
+SOURCES += main.cpp
@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QTextStream>
+
+#include <glm/glm.hpp>
+
+#include "camera.h"
+#include "optionparsing.h"
+#include "raytracer.h"
+#include "scenedata.h"
+#include "settings.h"
+#include "spherekernels.h"
+#include "threadpool.h"
+
+namespace
+{
+    // The camera poses the frames are rendered from
+    struct CameraPose
+    {
+        const char *name;
+        glm::dvec3 position;
+        double pitch;
+        double yaw;
+    };
+    const CameraPose kCameraPoses[] = {
+        { "front", glm::dvec3(0, 0, -5), 0, 0 },
+        { "close", glm::dvec3(0, 0, -2.5), 0, 0 },
+        { "side", glm::dvec3(1.5, 0.5, -3.5), 5, 20 }
+    };
+
+    struct AntiAliasingModeName
+    {
+        const char *name;
+        MyRaytracer::AntiAliasingMode mode;
+        // Zero if it varies
+        unsigned int samplesPerPixel;
+    };
+    const AntiAliasingModeName kAntiAliasingModes[] = {
+        { "none", MyRaytracer::kNoAntiAliasing, 1 },
+        { "full", MyRaytracer::kFullAntiAliasing, 4 },
+        { "adaptive", MyRaytracer::kAdaptiveAntiAliasing, 0 }
+    };
+
+    // A set of rays that is the same on every run
+    struct RaySet
+    {
+        QString name;
+        std::vector<MyRaytracer::Ray> rays;
+    };
+
+    // The primary rays of a square image looking at the sphereflake from the front
+    RaySet createPrimaryRays(unsigned int raysCount)
+    {
+        RaySet raySet;
+        raySet.name = "primary";
+
+        unsigned int side = std::max(1u, (unsigned int)sqrt(double(raysCount)));
+        for (unsigned int y = 0; y < side; y++) {
+            for (unsigned int x = 0; x < side; x++) {
+                MyRaytracer::Ray ray;
+                ray.origin = glm::dvec3(0, 0, -5);
+                ray.direction = glm::normalize(glm::dvec3(x - side / 2.0, y - side / 2.0, side));
+                raySet.rays.push_back(ray);
+            }
+        }
+
+        return raySet;
+    }
+
+    // Rays starting around the sphereflake and going through random points near it
+    RaySet createRandomRays(unsigned int raysCount)
+    {
+        RaySet raySet;
+        raySet.name = "random";
+
+        std::mt19937 generator(12345);
+        std::uniform_real_distribution<double> distribution(-1, 1);
+        while (raySet.rays.size() < raysCount) {
+            glm::dvec3 origin(distribution(generator), distribution(generator), distribution(generator));
+            if (glm::length(origin) < 0.1)
+                continue;
+            glm::dvec3 target(distribution(generator), distribution(generator), distribution(generator));
+
+            MyRaytracer::Ray ray;
+            ray.origin = glm::normalize(origin) * 5.0;
+            ray.direction = glm::normalize(target - ray.origin);
+            raySet.rays.push_back(ray);
+        }
+
+        return raySet;
+    }
+
+    bool parseLevels(const QString &text, unsigned int &minLevels, unsigned int &maxLevels)
+    {
+        QStringList parts = text.split('-');
+        if (parts.size() > 2)
+            return false;
+
+        bool minOk, maxOk;
+        minLevels = parts.first().toUInt(&minOk);
+        maxLevels = parts.last().toUInt(&maxOk);
+        return minOk && maxOk && minLevels > 0 && minLevels <= maxLevels;
+    }
+
+    // Describes how long it took to trace a number of rays
+    QJsonObject raysTiming(qint64 nanoseconds, quint64 raysCount)
+    {
+        QJsonObject timing;
+        timing["ms"] = nanoseconds / 1e6;
+        timing["rays"] = double(raysCount);
+        timing["nsPerRay"] = double(nanoseconds) / raysCount;
+        timing["raysPerSec"] = raysCount / (nanoseconds / 1e9);
+        return timing;
+    }
+
+    // The averages per ray, they show what a change to the traversal does apart from the timing noise
+    QJsonObject traversalStatsPerRay(const MyRaytracer::TraversalStats &stats)
+    {
+        double rays = stats.rays > 0 ? double(stats.rays) : 1.0;
+        QJsonObject perRay;
+        perRay["boundTests"] = stats.boundTests / rays;
+        perRay["sphereTests"] = stats.sphereTests / rays;
+        perRay["skippedSubtrees"] = stats.skippedSubtrees / rays;
+        perRay["hits"] = stats.hits / rays;
+        return perRay;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("sphereflake-bench");
+
+    QTextStream err(stderr);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times building the sphereflake, tracing fixed sets of rays and rendering frames "
+                                     "from fixed camera poses. Every timing is the best of a number of runs.");
+    parser.addHelpOption();
+
+    QCommandLineOption levelsOption(QStringList() << "l" << "levels", "Levels of the sphereflake to go through.",
+                                    "<min>-<max>", "1-8");
+    QCommandLineOption sizeOption(QStringList() << "s" << "size", "Size of the rendered frames.", "<width>x<height>",
+                                  QString("%1x%2").arg(kDefaultSceneWidth).arg(kDefaultSceneHeight));
+    QCommandLineOption raysOption("rays", "Rays in every set of rays.", "rays", "65536");
+    QCommandLineOption repeatOption(QStringList() << "r" << "repeat", "Runs of everything timed.", "runs", "3");
+    QCommandLineOption threadsOption(QStringList() << "t" << "threads", "Rendering threads, 0 is one per hardware thread.",
+                                     "threads", "0");
+    QCommandLineOption accelerationOption("accel", "Acceleration structure: tree, bvh4, bvh8 or procedural.",
+                                          "structure", "tree");
+    QCommandLineOption memoryOption("memory", "Memory of the tree: default or a comma separated list of thp "
+                                    "(transparent huge pages), hugetlb (reserved huge pages) and interleave (over the NUMA nodes).",
+                                    "flags", "default");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "File to write the JSON results to instead of stdout.",
+                                    "file");
+    parser.addOption(levelsOption);
+    parser.addOption(sizeOption);
+    parser.addOption(raysOption);
+    parser.addOption(repeatOption);
+    parser.addOption(threadsOption);
+    parser.addOption(accelerationOption);
+    parser.addOption(memoryOption);
+    parser.addOption(outputOption);
+
+    parser.process(app);
+
+    bool raysOk, repeatOk, threadsOk;
+    unsigned int raysCount = parser.value(raysOption).toUInt(&raysOk);
+    unsigned int repeatCount = parser.value(repeatOption).toUInt(&repeatOk);
+    unsigned int threadsCount = parser.value(threadsOption).toUInt(&threadsOk);
+    unsigned int minLevels, maxLevels, width, height;
+    MyRaytracer::AccelerationStructure accelerationStructure;
+    unsigned int nodeMemoryFlags;
+    if (!raysOk || raysCount == 0 || !repeatOk || repeatCount == 0 || !threadsOk ||
+        !parseLevels(parser.value(levelsOption), minLevels, maxLevels) ||
+        !MyRaytracer::parseSize(parser.value(sizeOption), width, height) ||
+        !MyRaytracer::parseAccelerationStructure(parser.value(accelerationOption), accelerationStructure) ||
+        !MyRaytracer::parseNodeMemoryFlags(parser.value(memoryOption), nodeMemoryFlags)) {
+        err << "Invalid arguments, see --help" << endl;
+        return 1;
+    }
+
+    MyRaytracer::ThreadPool threadPool(threadsCount);
+    MyRaytracer::SceneData sceneData(threadPool);
+    MyRaytracer::RayTracer rayTracer(sceneData, threadPool);
+    MyRaytracer::Camera camera(width, height, glm::dvec3(0, 0, -5));
+
+    sceneData.setLightPos(glm::dvec3(-0.6, 5, -10));
+    sceneData.setAccelerationStructure(accelerationStructure);
+    sceneData.setNodeMemoryFlags(nodeMemoryFlags);
+
+    std::vector<unsigned char> frameBuffer(size_t(width) * height);
+    rayTracer.setFrameBuffer(frameBuffer.data());
+    rayTracer.setFrameSize(width, height);
+    rayTracer.setZoomLevel(std::max(width, height));
+
+    std::vector<RaySet> raySets;
+    raySets.push_back(createPrimaryRays(raysCount));
+    raySets.push_back(createRandomRays(raysCount));
+
+    QJsonObject config;
+    config["threads"] = int(threadPool.getThreadsCount());
+    config["kernel"] = MyRaytracer::getSpheresKernelIsaName(sceneData.getSpheresKernelIsa());
+    config["accelerationStructure"] = parser.value(accelerationOption);
+    config["nodeMemory"] = parser.value(memoryOption);
+#ifdef SPHEREFLAKE_FLOAT_STORAGE
+    config["floatStorage"] = true;
+#else
+    config["floatStorage"] = false;
+#endif
+    config["packetSize"] = int(rayTracer.getPacketSize());
+    config["tileSize"] = int(rayTracer.getTileSize());
+    config["width"] = int(width);
+    config["height"] = int(height);
+    config["repeat"] = int(repeatCount);
+
+    QElapsedTimer timer;
+    QJsonArray results;
+
+    for (unsigned int levels = minLevels; levels <= maxLevels; levels++) {
+        err << "Levels " << levels << " ..." << endl;
+
+        QJsonObject levelResults;
+        levelResults["levels"] = int(levels);
+
+        // Building
+        qint64 bestBuildTime = std::numeric_limits<qint64>::max();
+        bool built = true;
+        for (unsigned int run = 0; run < repeatCount && built; run++) {
+            timer.start();
+            built = sceneData.buildStructure(levels) && sceneData.getAccelerationStructure() == accelerationStructure;
+            bestBuildTime = std::min(bestBuildTime, timer.nsecsElapsed());
+        }
+        if (!built) {
+            levelResults["error"] = QString("Failed to build the structure");
+            results.append(levelResults);
+            break;
+        }
+        levelResults["spheres"] = double(sceneData.getSpheresCount());
+        levelResults["buildMs"] = bestBuildTime / 1e6;
+
+        // Single rays on the calling thread
+        QJsonArray raySetResults;
+        for (size_t setIdx = 0; setIdx < raySets.size(); setIdx++) {
+            const std::vector<MyRaytracer::Ray> &rays = raySets[setIdx].rays;
+
+            qint64 bestTime = std::numeric_limits<qint64>::max();
+            unsigned int hitsCount = 0;
+            for (unsigned int run = 0; run < repeatCount; run++) {
+                MyRaytracer::Intersection intersection;
+                hitsCount = 0;
+
+                timer.start();
+                for (size_t rayIdx = 0; rayIdx < rays.size(); rayIdx++) {
+                    if (sceneData.getIntersection(rays[rayIdx], intersection))
+                        hitsCount++;
+                }
+                bestTime = std::min(bestTime, timer.nsecsElapsed());
+            }
+
+            QJsonObject raySetResult = raysTiming(bestTime, rays.size());
+            raySetResult["set"] = raySets[setIdx].name;
+            // Helps to notice optimizations that change the result
+            raySetResult["hits"] = int(hitsCount);
+
+            // Counted in a pass of its own, so that the timing above is not affected
+            MyRaytracer::TraversalStats traversalStats;
+            MyRaytracer::Intersection intersection;
+            for (size_t rayIdx = 0; rayIdx < rays.size(); rayIdx++)
+                sceneData.getIntersection(rays[rayIdx], intersection, traversalStats);
+            raySetResult["traversal"] = traversalStatsPerRay(traversalStats);
+            raySetResults.append(raySetResult);
+        }
+        levelResults["getIntersection"] = raySetResults;
+
+        // The same rays as occlusion queries without a distance limit, so they find the same hits
+        QJsonArray occlusionResults;
+        for (size_t setIdx = 0; setIdx < raySets.size(); setIdx++) {
+            const std::vector<MyRaytracer::Ray> &rays = raySets[setIdx].rays;
+            const double maxT = std::numeric_limits<double>::max();
+
+            qint64 bestTime = std::numeric_limits<qint64>::max();
+            qint64 bestBatchedTime = std::numeric_limits<qint64>::max();
+            unsigned int occludedCount = 0;
+            for (unsigned int run = 0; run < repeatCount; run++) {
+                occludedCount = 0;
+
+                timer.start();
+                for (size_t rayIdx = 0; rayIdx < rays.size(); rayIdx++) {
+                    if (sceneData.occluded(rays[rayIdx], maxT))
+                        occludedCount++;
+                }
+                bestTime = std::min(bestTime, timer.nsecsElapsed());
+
+                double maxTs[MyRaytracer::SceneData::kMaxPacketSize];
+                bool occluded[MyRaytracer::SceneData::kMaxPacketSize];
+                std::fill(maxTs, maxTs + MyRaytracer::SceneData::kMaxPacketSize, maxT);
+
+                timer.start();
+                for (size_t firstRay = 0; firstRay < rays.size(); firstRay += MyRaytracer::SceneData::kMaxPacketSize) {
+                    unsigned int count = (unsigned int)std::min<size_t>(rays.size() - firstRay, 
+                                                                        MyRaytracer::SceneData::kMaxPacketSize);
+                    sceneData.occluded(rays.data() + firstRay, count, maxTs, occluded);
+                }
+                bestBatchedTime = std::min(bestBatchedTime, timer.nsecsElapsed());
+            }
+
+            QJsonObject occlusionResult = raysTiming(bestTime, rays.size());
+            occlusionResult["set"] = raySets[setIdx].name;
+            occlusionResult["occluded"] = int(occludedCount);
+            occlusionResult["batched"] = raysTiming(bestBatchedTime, rays.size());
+            occlusionResults.append(occlusionResult);
+        }
+        levelResults["occluded"] = occlusionResults;
+
+        // Whole frames on the thread pool
+        QJsonArray frameResults;
+        for (size_t poseIdx = 0; poseIdx < sizeof(kCameraPoses) / sizeof(kCameraPoses[0]); poseIdx++) {
+            const CameraPose &pose = kCameraPoses[poseIdx];
+            camera.setPose(pose.position, pose.pitch, pose.yaw);
+            rayTracer.setViewMatrix(camera.getViewMatrix());
+
+            for (size_t modeIdx = 0; modeIdx < sizeof(kAntiAliasingModes) / sizeof(kAntiAliasingModes[0]); modeIdx++) {
+                const AntiAliasingModeName &antiAliasing = kAntiAliasingModes[modeIdx];
+                rayTracer.setAntiAliasingMode(antiAliasing.mode);
+
+                qint64 bestTime = std::numeric_limits<qint64>::max();
+                for (unsigned int run = 0; run < repeatCount; run++) {
+                    timer.start();
+                    rayTracer.traceFrame();
+                    bestTime = std::min(bestTime, timer.nsecsElapsed());
+                }
+
+                // The rays of the adaptive anti-aliasing depend on the image, so the frames are compared per pixel
+                quint64 pixelsCount = quint64(width) * height;
+                QJsonObject frameResult;
+                if (antiAliasing.samplesPerPixel > 0)
+                    frameResult = raysTiming(bestTime, pixelsCount * antiAliasing.samplesPerPixel);
+                frameResult["ms"] = bestTime / 1e6;
+                frameResult["nsPerPixel"] = double(bestTime) / pixelsCount;
+                frameResult["pose"] = QString(pose.name);
+                frameResult["antiAliasing"] = QString(antiAliasing.name);
+                frameResults.append(frameResult);
+            }
+        }
+        levelResults["traceFrame"] = frameResults;
+
+        results.append(levelResults);
+    }
+
+    QJsonObject report;
+    report["config"] = config;
+    report["results"] = results;
+    QByteArray json = QJsonDocument(report).toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile outputFile(parser.value(outputOption));
+        if (!outputFile.open(QIODevice::WriteOnly) || outputFile.write(json) != json.size()) {
+            err << "Failed to write " << outputFile.fileName() << endl;
+            return 1;
+        }
+    } else {
+        QTextStream(stdout) << json;
+    }
+
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <QDebug>
 
 #include <glm/glm.hpp>
@@ -25,6 +27,30 @@ namespace MyRaytracer
         viewMatrix_ = glm::translate(glm::dmat4(1.0f), -position_);
     }
 
+    void Camera::setWindowSize(unsigned int windowWidth, unsigned int windowHeight)
+    {
+        int oldSize = std::max(windowMidX_, windowMidY_);
+
+        windowMidX_ = windowWidth / 2;
+        windowMidY_ = windowHeight / 2;
+
+        int newSize = std::max(windowMidX_, windowMidY_);
+        if (oldSize > 0 && newSize > 0)
+            zoomZ_ = std::max(1, int((long long)zoomZ_ * newSize / oldSize));
+    }
+
+    void Camera::setPose(const glm::dvec3 &newPosition, double pitch, double yaw)
+    {
+        reset(newPosition);
+
+        rotation_ = glm::dvec3(pitch, yaw, 0);
+
+        // The same rotation mouseMove does, just all at once
+        glm::dmat4 rotationMatrix = glm::rotate(glm::dmat4(1.0f), glm::radians(yaw), glm::dvec3(0.0f, 1.0f, 0.0f));
+        rotationMatrix = glm::rotate(rotationMatrix, glm::radians(pitch), glm::dvec3(1.0f, 0.0f, 0.0f));
+        viewMatrix_ = rotationMatrix * viewMatrix_;
+    }
+
     void Camera::mouseMove(int deltaX, int deltaY)
     {
         double dx = -(kPitchSensitivity * deltaY);
@@ -33,8 +59,9 @@ namespace MyRaytracer
         rotation_.x += dx;
         rotation_.y += dy;
 
-        viewMatrix_ = glm::rotate(glm::dmat4(1.0f), glm::radians(dy), glm::dvec3(0.0f, 1.0f, 0.0f));
-        viewMatrix_ = glm::rotate(viewMatrix_, glm::radians(dx), glm::dvec3(1.0f, 0.0f, 0.0f));
+        glm::dmat4 rotationMatrix = glm::rotate(glm::dmat4(1.0f), glm::radians(dy), glm::dvec3(0.0f, 1.0f, 0.0f));
+        rotationMatrix = glm::rotate(rotationMatrix, glm::radians(dx), glm::dvec3(1.0f, 0.0f, 0.0f));
+        viewMatrix_ = rotationMatrix * viewMatrix_;
 
         // Limit loking up/down in 0..360
         if (rotation_.x < 0)
@@ -82,6 +109,6 @@ namespace MyRaytracer
         }
 
         position_ += movement;
-        viewMatrix_ = glm::translate(glm::dmat4(1.0f), -movement);
+        viewMatrix_ = glm::translate(glm::dmat4(1.0f), -movement) * viewMatrix_;
     }
 }
\ No newline at end of file
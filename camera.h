@@ -18,6 +18,10 @@ namespace MyRaytracer
         void move(bool moveForward, bool moveBackward, bool moveLeft, bool moveRight);
 
         void reset(const glm::dvec3 &newPosition);
+        // Changes the size of the window, the zoom is scaled to keep the same field of view
+        void setWindowSize(unsigned int windowWidth, unsigned int windowHeight);
+        // Puts the camera at a position, turned up&down by pitch and left&right by yaw degrees
+        void setPose(const glm::dvec3 &newPosition, double pitch, double yaw);
 
         glm::dvec3 getPosition() const { return position_; }
         glm::dvec3 getRotation() const { return rotation_; }
@@ -26,6 +30,8 @@ namespace MyRaytracer
         void zoomOut() { if (zoomZ_ > kZoomSensitivity) zoomZ_-= kZoomSensitivity; }
         int getZoom() const { return zoomZ_; }
 
+        // Returns the transformation from scene space to camera space.
+        // All the moves since the last reset are accumulated in it.
         glm::dmat4 getViewMatrix() const { return viewMatrix_; }
 
     private:
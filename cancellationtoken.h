@@ -0,0 +1,28 @@
+#ifndef CANCELLATIONTOKEN_H
+#define CANCELLATIONTOKEN_H
+
+#include <atomic>
+
+namespace MyRaytracer
+{
+    // A flag that one thread raises to tell the work running on other threads to give up.
+    // Checking it is a single atomic load, so the workers can do it between small pieces of work.
+    class CancellationToken
+    {
+    public:
+        CancellationToken() : cancelled_(false) {}
+
+        void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+        void reset() { cancelled_.store(false, std::memory_order_relaxed); }
+        bool isCancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    private:
+        // Disables copying and assigning
+        CancellationToken &operator=(const CancellationToken &);
+        CancellationToken(const CancellationToken &);
+
+        std::atomic<bool> cancelled_;
+    };
+}
+
+#endif //CANCELLATIONTOKEN_H
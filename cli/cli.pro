@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# Headless renderer - renders a single frame and saves it to a file
+#
+#-------------------------------------------------
+
+QT       += core gui
+
+TARGET = sphereflake-cli
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../sphereflake.pri)
+
+SOURCES += main.cpp
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QStringList>
+#include <QTextStream>
+
+#include <glm/vec3.hpp>
+
+#include "camera.h"
+#include "optionparsing.h"
+#include "raytracer.h"
+#include "scenedata.h"
+#include "settings.h"
+#include "threadpool.h"
+
+namespace
+{
+    // Parses a "x,y,z" triple
+    bool parseVector(const QString &text, glm::dvec3 &vector)
+    {
+        QStringList parts = text.split(',');
+        if (parts.size() != 3)
+            return false;
+
+        bool ok[3];
+        vector = glm::dvec3(parts[0].toDouble(&ok[0]), parts[1].toDouble(&ok[1]), parts[2].toDouble(&ok[2]));
+        return ok[0] && ok[1] && ok[2];
+    }
+
+    bool parseAntiAliasingMode(const QString &text, MyRaytracer::AntiAliasingMode &antiAliasingMode)
+    {
+        if (text == "none")
+            antiAliasingMode = MyRaytracer::kNoAntiAliasing;
+        else if (text == "full")
+            antiAliasingMode = MyRaytracer::kFullAntiAliasing;
+        else if (text == "adaptive")
+            antiAliasingMode = MyRaytracer::kAdaptiveAntiAliasing;
+        else
+            return false;
+
+        return true;
+    }
+
+    // Prints the totals and the averages per ray
+    void printTraversalStats(QTextStream &out, const QString &name, const MyRaytracer::TraversalStats &stats)
+    {
+        double rays = stats.rays > 0 ? double(stats.rays) : 1.0;
+        out << name << ": " << stats.rays << " rays, bound tests: " << stats.boundTests 
+            << " (" << stats.boundTests / rays << " per ray), sphere tests: " << stats.sphereTests
+            << " (" << stats.sphereTests / rays << "), skipped subtrees: " << stats.skippedSubtrees
+            << " (" << stats.skippedSubtrees / rays << "), hits: " << stats.hits 
+            << " (" << stats.hits / rays << ")" << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("sphereflake-cli");
+
+    QTextStream err(stderr);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders a single frame of the sphereflake without a window");
+    parser.addHelpOption();
+    parser.addPositionalArgument("output", "The image to write, its format follows the extension (png, pgm, bmp ...)");
+
+    QCommandLineOption levelsOption(QStringList() << "l" << "levels", "Levels of the sphereflake.", "levels", "7");
+    QCommandLineOption sizeOption(QStringList() << "s" << "size", "Size of the image.", "<width>x<height>",
+                                  QString("%1x%2").arg(kDefaultSceneWidth).arg(kDefaultSceneHeight));
+    QCommandLineOption positionOption("camera", "Position of the camera.", "x,y,z", "0,0,-5");
+    QCommandLineOption pitchOption("pitch", "Camera rotation up&down in degrees.", "degrees", "0");
+    QCommandLineOption yawOption("yaw", "Camera rotation left&right in degrees.", "degrees", "0");
+    QCommandLineOption zoomOption("zoom", "Zoom level, the bigger side of the image by default.", "zoom");
+    QCommandLineOption antiAliasingOption("aa", "Anti-aliasing: none, full or adaptive.", "mode", "full");
+    QCommandLineOption threadsOption(QStringList() << "t" << "threads", "Rendering threads, 0 is one per hardware thread.",
+                                     "threads", "0");
+    QCommandLineOption accelerationOption("accel", "Acceleration structure: tree, bvh4, bvh8 or procedural.",
+                                          "structure", "tree");
+    QCommandLineOption memoryOption("memory", "Memory of the tree: default or a comma separated list of thp "
+                                    "(transparent huge pages), hugetlb (reserved huge pages) and interleave (over the NUMA nodes).",
+                                    "flags", "default");
+    QCommandLineOption heatmapOption("heatmap", "Write the cost of every pixel in false colors instead of the scene.");
+    QCommandLineOption statsOption("stats", "Print what the traversals did in total and on every thread.");
+    QCommandLineOption cacheOption("cache", "Keep the trees built in a directory and map them from there next time.",
+                                   "directory");
+    parser.addOption(levelsOption);
+    parser.addOption(sizeOption);
+    parser.addOption(positionOption);
+    parser.addOption(pitchOption);
+    parser.addOption(yawOption);
+    parser.addOption(zoomOption);
+    parser.addOption(antiAliasingOption);
+    parser.addOption(threadsOption);
+    parser.addOption(accelerationOption);
+    parser.addOption(memoryOption);
+    parser.addOption(heatmapOption);
+    parser.addOption(statsOption);
+    parser.addOption(cacheOption);
+
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        err << "Expected a single output file" << endl;
+        return 1;
+    }
+    QString outputFile = parser.positionalArguments().first();
+
+    bool levelsOk, pitchOk, yawOk, threadsOk;
+    unsigned int levels = parser.value(levelsOption).toUInt(&levelsOk);
+    double pitch = parser.value(pitchOption).toDouble(&pitchOk);
+    double yaw = parser.value(yawOption).toDouble(&yawOk);
+    unsigned int threadsCount = parser.value(threadsOption).toUInt(&threadsOk);
+    unsigned int width, height;
+    glm::dvec3 cameraPosition;
+    MyRaytracer::AccelerationStructure accelerationStructure;
+    MyRaytracer::AntiAliasingMode antiAliasingMode;
+    unsigned int nodeMemoryFlags;
+    if (!levelsOk || levels == 0 || !pitchOk || !yawOk || !threadsOk ||
+        !MyRaytracer::parseSize(parser.value(sizeOption), width, height) ||
+        !parseVector(parser.value(positionOption), cameraPosition) ||
+        !MyRaytracer::parseAccelerationStructure(parser.value(accelerationOption), accelerationStructure) ||
+        !parseAntiAliasingMode(parser.value(antiAliasingOption), antiAliasingMode) ||
+        !MyRaytracer::parseNodeMemoryFlags(parser.value(memoryOption), nodeMemoryFlags)) {
+        err << "Invalid arguments, see --help" << endl;
+        return 1;
+    }
+
+    int zoomLevel = std::max(width, height);
+    if (parser.isSet(zoomOption)) {
+        bool zoomOk;
+        zoomLevel = parser.value(zoomOption).toInt(&zoomOk);
+        if (!zoomOk || zoomLevel <= 0) {
+            err << "Invalid zoom level" << endl;
+            return 1;
+        }
+    }
+
+    MyRaytracer::ThreadPool threadPool(threadsCount);
+    MyRaytracer::SceneData sceneData(threadPool);
+    MyRaytracer::RayTracer rayTracer(sceneData, threadPool);
+    MyRaytracer::Camera camera(width, height, cameraPosition);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    sceneData.setLightPos(glm::dvec3(-0.6, 5, -10));
+    sceneData.setAccelerationStructure(accelerationStructure);
+    sceneData.setNodeMemoryFlags(nodeMemoryFlags);
+    if (parser.isSet(cacheOption))
+        sceneData.setTreeCacheDirectory(parser.value(cacheOption));
+    if (!sceneData.buildStructure(levels)) {
+        err << "Failed to create a structure with " << levels << " levels" << endl;
+        return 1;
+    }
+    if (sceneData.getAccelerationStructure() != accelerationStructure) {
+        err << "Failed to build the acceleration structure" << endl;
+        return 1;
+    }
+    qint64 buildTime = timer.restart();
+
+    QImage image(width, height, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int i = 0; i < 256; i++) {
+        if (parser.isSet(heatmapOption)) {
+            glm::dvec3 color = MyRaytracer::heatmapColor(i);
+            colorTable.push_back(qRgb(255 * color.r, 255 * color.g, 255 * color.b));
+        } else {
+            colorTable.push_back(qRgb(i, i, i));
+        }
+    }
+    image.setColorTable(colorTable);
+
+    camera.setPose(cameraPosition, pitch, yaw);
+
+    rayTracer.setFrameBuffer(image.bits(), image.bytesPerLine());
+    rayTracer.setFrameSize(width, height);
+    rayTracer.setAntiAliasingMode(antiAliasingMode);
+    rayTracer.setZoomLevel(zoomLevel);
+    rayTracer.setViewMatrix(camera.getViewMatrix());
+    rayTracer.setCostHeatmapEnabled(parser.isSet(heatmapOption));
+    rayTracer.setTraversalStatsEnabled(parser.isSet(statsOption));
+    rayTracer.traceFrame();
+    qint64 renderTime = timer.elapsed();
+
+    if (!image.save(outputFile)) {
+        err << "Failed to write " << outputFile << endl;
+        return 1;
+    }
+
+    err << "Spheres: " << sceneData.getSpheresCount() << ", build: " << buildTime 
+        << " ms, render: " << renderTime << " ms" << endl;
+
+    if (parser.isSet(statsOption)) {
+        printTraversalStats(err, "Frame", rayTracer.getFrameTraversalStats());
+        std::vector<MyRaytracer::TraversalStats> threadStats = rayTracer.getThreadTraversalStats();
+        for (size_t threadIdx = 0; threadIdx < threadStats.size(); threadIdx++) {
+            if (threadStats[threadIdx].rays > 0)
+                printTraversalStats(err, QString("Thread %1").arg(threadIdx), threadStats[threadIdx]);
+        }
+    }
+
+    // The tree may still be going to the cache
+    sceneData.waitForTreeCache();
+
+    return 0;
+}
@@ -7,44 +7,91 @@
 
 #include "camera.h"
 #include "glwidget.h"
-#include "raytracer.h"
+#include "renderthread.h"
 #include "settings.h"
 
 GLWidget::GLWidget(QWidget *parent, 
                    MyRaytracer::Camera& camera, 
-                   MyRaytracer::RayTracer &rayTracer_)
+                   RenderThread &renderThread)
     : QOpenGLWidget(parent),
-      imageData_(kSceneWidth, kSceneHeight, QImage::Format_Indexed8),
       camera_(camera),
-      rayTracer_(rayTracer_)
-
+      renderThread_(renderThread),
+      progressiveRendering_(true),
+      antiAliasingMode_(MyRaytracer::kAdaptiveAntiAliasing),
+      temporalReprojection_(false),
+      costHeatmap_(false)
 {
-    setFixedSize(kSceneWidth, kSceneHeight);
+    setMinimumSize(64, 64);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
     setAutoFillBackground(false);
     setMouseTracking(true);
     setFocus();
 
-    QVector<QRgb> grayScaleTable;
-    for(int i = 0; i < 256; i++)
-        grayScaleTable.push_back(qRgb(i,i,i));
-    imageData_.setColorTable(grayScaleTable);
-    imageData_.fill(0);
+    connect(&renderThread_, SIGNAL(frameReady(QImage)), this, SLOT(showFrame(QImage)));
+}
+
+QSize GLWidget::sizeHint() const
+{
+    return QSize(kDefaultSceneWidth, kDefaultSceneHeight);
+}
 
-    rayTracer_.setFrameBuffer(imageData_.bits());
+void GLWidget::resizeGL(int width, int height)
+{
+    // The last frame is stretched over the widget until the one with the new size is ready
+    camera_.setWindowSize(width, height);
+    redraw();
 }
 
 void GLWidget::paintGL()
 {
     QPainter painter(this);
+    painter.drawImage(this->rect(), imageData_);
+}
 
-    // TODO : research more
-    // Call to .bits() seems necessary because it "invalidates" the buffer
-    // and drawImage knows that it has something new there.
-    // It's not expensive though.
-    imageData_.bits();
+void GLWidget::showFrame(const QImage &frame)
+{
+    // Shares the pixels with the render thread, it renders the next frame in another image
+    imageData_ = frame;
+    update();
+}
 
-    rayTracer_.traceFrame();
-    painter.drawImage(this->rect(), imageData_);
+void GLWidget::redraw()
+{
+    FrameSettings settings;
+    settings.viewMatrix = camera_.getViewMatrix();
+    settings.zoomLevel = camera_.getZoom();
+    settings.width = width();
+    settings.height = height();
+    settings.antiAliasingMode = antiAliasingMode_;
+    settings.progressiveRendering = progressiveRendering_;
+    settings.temporalReprojection = temporalReprojection_;
+    settings.costHeatmap = costHeatmap_;
+
+    renderThread_.requestFrame(settings);
+}
+
+void GLWidget::setProgressiveRendering(bool enabled)
+{
+    progressiveRendering_ = enabled;
+    redraw();
+}
+
+void GLWidget::setAntiAliasingMode(MyRaytracer::AntiAliasingMode antiAliasingMode)
+{
+    antiAliasingMode_ = antiAliasingMode;
+    redraw();
+}
+
+void GLWidget::setTemporalReprojection(bool enabled)
+{
+    temporalReprojection_ = enabled;
+    redraw();
+}
+
+void GLWidget::setCostHeatmap(bool enabled)
+{
+    costHeatmap_ = enabled;
+    redraw();
 }
 
 void GLWidget::mousePressEvent(QMouseEvent *event)
@@ -67,7 +114,7 @@ void GLWidget::wheelEvent(QWheelEvent* event)
     else 
         camera_.zoomOut();
 
-    repaint();
+    redraw();
 }
 
 void GLWidget::mouseMoveEvent(QMouseEvent *event)
@@ -106,15 +153,13 @@ void GLWidget::keyPressEvent(QKeyEvent *event)
 
     case Qt::Key_Plus:
         camera_.zoomIn();
-        rayTracer_.setZoomLevel(camera_.getZoom());
-        repaint();
+        redraw();
         // no need to transform points => don't emit cameraMoved
         return;
 
     case Qt::Key_Minus:
         camera_.zoomOut();
-        rayTracer_.setZoomLevel(camera_.getZoom());
-        repaint();
+        redraw();
         // no need to transform points => don't emit cameraMoved
         return;
 
@@ -4,26 +4,43 @@
 #include <QOpenGLWidget>
 #include <QImage>
 
+#include "raytracer.h"
 
 namespace MyRaytracer 
 {
     class Camera;
-    class RayTracer;
     class SceneData;
 };
 
+class RenderThread;
+
 class GLWidget : public QOpenGLWidget
 {
     Q_OBJECT
 
 public:
-    GLWidget(QWidget *parent, MyRaytracer::Camera &camera, MyRaytracer::RayTracer &rayTracer_);
+    GLWidget(QWidget *parent, MyRaytracer::Camera &camera, RenderThread &renderThread);
+
+    QSize sizeHint() const;
+
+    // Requests a new frame from the render thread. With progressive rendering a coarse 
+    // preview is shown straight away and it's refined while the camera stays still.
+    void redraw();
+    void setProgressiveRendering(bool enabled);
+    void setAntiAliasingMode(MyRaytracer::AntiAliasingMode antiAliasingMode);
+    void setTemporalReprojection(bool enabled);
+    void setCostHeatmap(bool enabled);
+
+public slots:
+    // Shows a frame the render thread is done with
+    void showFrame(const QImage &frame);
 
 signals:
     void cameraMoved();
 
 protected:
     void paintGL();
+    void resizeGL(int width, int height);
 
     void mousePressEvent(QMouseEvent *event);
     void mouseMoveEvent(QMouseEvent *event);
@@ -33,9 +50,15 @@ protected:
 
 private:
     MyRaytracer::Camera &camera_;
-    MyRaytracer::RayTracer &rayTracer_;
+    RenderThread &renderThread_;
     
+    // The last frame rendered
     QImage imageData_;
+
+    bool progressiveRendering_;
+    MyRaytracer::AntiAliasingMode antiAliasingMode_;
+    bool temporalReprojection_;
+    bool costHeatmap_;
     
     int prevMouseX_;
     int prevMouseY_;
@@ -1,14 +1,18 @@
 #include <QApplication>
 #include <QCheckBox>
+#include <QComboBox>
 #include <QDesktopWidget>
 #include <QGroupBox>
 #include <QHBoxLayout>
 #include <QLabel>
 #include <QMessageBox>
+#include <QSlider>
 #include <QSpinBox>
+#include <QStandardPaths>
 #include <QTimer>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "glwidget.h"
 #include "mainwindow.h"
@@ -18,25 +22,32 @@
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent),
-      camera_(kSceneWidth, kSceneHeight, glm::dvec3(0, 0, -5)),
-      rayTracer_(sceneData_)
+      camera_(kDefaultSceneWidth, kDefaultSceneHeight, glm::dvec3(0, 0, -5)),
+      rayTracer_(sceneData_, threadPool_),
+      sceneData_(threadPool_),
+      renderThread_(rayTracer_)
 {
     setupWidgets();
     setWindowTitle(tr("Sphereflake renderer"));
     
-    levelsSpin->setRange(1, 7);
+    levelsSpin->setRange(1, kMaxMaterializedLevels);
     levelsSpin->setValue(7);
-    antiAliasingCheckbox->setChecked(true);
+    antiAliasingCombo->setCurrentIndex(MyRaytracer::kAdaptiveAntiAliasing);
+    progressiveRenderingCheckbox->setChecked(true);
 
     glWidget->setFocus();
     connect(glWidget, SIGNAL(cameraMoved()), this, SLOT(cameraMoved()));
     connect(levelsSpin, SIGNAL(valueChanged(int)), this, SLOT(createSceneStructure(int)));
-    connect(antiAliasingCheckbox, SIGNAL(toggled(bool)), this, SLOT(antiAliasingChecked(bool)));
-
-    rayTracer_.setAntiAliasing(true);
-    rayTracer_.setZoomLevel(kSceneWidth > kSceneHeight ? kSceneWidth : kSceneHeight);
-
-    sceneData_.setLightPos(glm::dvec3(-0.6, 5, -10));
+    connect(antiAliasingCombo, SIGNAL(currentIndexChanged(int)), this, SLOT(antiAliasingModeChanged(int)));
+    connect(accelerationCombo, SIGNAL(currentIndexChanged(int)), this, SLOT(accelerationStructureChanged(int)));
+    connect(progressiveRenderingCheckbox, SIGNAL(toggled(bool)), this, SLOT(progressiveRenderingChecked(bool)));
+    connect(temporalReprojectionCheckbox, SIGNAL(toggled(bool)), this, SLOT(temporalReprojectionChecked(bool)));
+    connect(costHeatmapCheckbox, SIGNAL(toggled(bool)), this, SLOT(costHeatmapChecked(bool)));
+    connect(treeCacheCheckbox, SIGNAL(toggled(bool)), this, SLOT(treeCacheChecked(bool)));
+    connect(lightAngleSlider, SIGNAL(valueChanged(int)), this, SLOT(lightAngleChanged(int)));
+
+    sceneData_.setLightPos(glm::dvec3(kDefaultLightPosX, kDefaultLightPosY, kDefaultLightPosZ));
+    renderThread_.start();
     createSceneStructure(7);
 }
 
@@ -56,15 +67,50 @@ void MainWindow::setupWidgets()
     levelsSpin->setFocusPolicy(Qt::NoFocus);
     vbox->addWidget(new QLabel("Levels: "));
     vbox->addWidget(levelsSpin);
-    antiAliasingCheckbox = new QCheckBox("Anti-aliasing");
-    vbox->addWidget(antiAliasingCheckbox);
+    antiAliasingCombo = new QComboBox();
+    antiAliasingCombo->setFocusPolicy(Qt::NoFocus);
+    // The order matches MyRaytracer::AntiAliasingMode
+    antiAliasingCombo->addItem(tr("Off"));
+    antiAliasingCombo->addItem(tr("4 samples per pixel"));
+    antiAliasingCombo->addItem(tr("Adaptive"));
+    vbox->addWidget(new QLabel("Anti-aliasing: "));
+    vbox->addWidget(antiAliasingCombo);
+    progressiveRenderingCheckbox = new QCheckBox("Progressive rendering");
+    progressiveRenderingCheckbox->setFocusPolicy(Qt::NoFocus);
+    vbox->addWidget(progressiveRenderingCheckbox);
+    temporalReprojectionCheckbox = new QCheckBox("Reuse the previous frame");
+    temporalReprojectionCheckbox->setFocusPolicy(Qt::NoFocus);
+    vbox->addWidget(temporalReprojectionCheckbox);
+    costHeatmapCheckbox = new QCheckBox("Show the traversal cost");
+    costHeatmapCheckbox->setFocusPolicy(Qt::NoFocus);
+    vbox->addWidget(costHeatmapCheckbox);
+    treeCacheCheckbox = new QCheckBox("Keep the trees on disk");
+    treeCacheCheckbox->setFocusPolicy(Qt::NoFocus);
+    treeCacheCheckbox->setToolTip(tr("The trees built are written to %1 and loaded from there the next time. "
+        "They take a lot of space - 1.5 GB with 9 levels and 14 GB with 10.")
+        .arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)));
+    vbox->addWidget(treeCacheCheckbox);
+    accelerationCombo = new QComboBox();
+    accelerationCombo->setFocusPolicy(Qt::NoFocus);
+    // The order matches MyRaytracer::AccelerationStructure
+    accelerationCombo->addItem(tr("Sphereflake tree"));
+    accelerationCombo->addItem(tr("4-wide BVH"));
+    accelerationCombo->addItem(tr("8-wide BVH"));
+    accelerationCombo->addItem(tr("Procedural instances"));
+    vbox->addWidget(new QLabel("Acceleration structure: "));
+    vbox->addWidget(accelerationCombo);
+    lightAngleSlider = new QSlider(Qt::Horizontal);
+    lightAngleSlider->setFocusPolicy(Qt::NoFocus);
+    lightAngleSlider->setRange(-90, 90);
+    vbox->addWidget(new QLabel("Light direction: "));
+    vbox->addWidget(lightAngleSlider);
     spheresCountLbl = new QLabel("Spheres: ");
     vbox->addWidget(spheresCountLbl);
     
     vbox->addStretch();
     toolboxWidget->setLayout(vbox);
 
-    glWidget = new GLWidget(this, camera_, rayTracer_);
+    glWidget = new GLWidget(this, camera_, renderThread_);
     mainLayout->addWidget(glWidget);
     mainLayout->addWidget(toolboxWidget);
 
@@ -74,8 +120,7 @@ void MainWindow::setupWidgets()
 
 void MainWindow::cameraMoved() 
 {
-    sceneData_.transformPoints(camera_.getViewMatrix());
-    glWidget->repaint();
+    glWidget->redraw();
 
     cameraPosLbl->setText(QString("camera pos : [%1, %2, %3]").
         arg(QString::number(camera_.getPosition().x, 'f', 2)).
@@ -90,7 +135,12 @@ void MainWindow::cameraMoved()
 
 void MainWindow::createSceneStructure(int levels)
 {
-    if (sceneData_.buildStructure(levels)) {
+    // The scene can't change under the render thread
+    renderThread_.pause();
+    bool built = sceneData_.buildStructure(levels);
+    renderThread_.resume();
+
+    if (built) {
         camera_.reset(glm::dvec3(0, 0, -5));
         cameraMoved();
     } else {
@@ -101,8 +151,67 @@ void MainWindow::createSceneStructure(int levels)
     spheresCountLbl->setText(QString("Spheres : %1").arg(sceneData_.getSpheresCount()));
 }
 
-void MainWindow::antiAliasingChecked(bool state)
+void MainWindow::antiAliasingModeChanged(int index)
+{
+    glWidget->setAntiAliasingMode(static_cast<MyRaytracer::AntiAliasingMode>(index));
+}
+
+void MainWindow::accelerationStructureChanged(int index)
+{
+    MyRaytracer::AccelerationStructure accelerationStructure = static_cast<MyRaytracer::AccelerationStructure>(index);
+    bool proceduralInstances = accelerationStructure == MyRaytracer::kProceduralInstances;
+
+    // Only the procedural instances can go that deep. Lowering the maximum lowers the
+    // levels too, so the scene is rebuilt before its whole tree is put in memory.
+    levelsSpin->setMaximum(proceduralInstances ? kMaxProceduralLevels : kMaxMaterializedLevels);
+
+    renderThread_.pause();
+    bool built = sceneData_.setAccelerationStructure(accelerationStructure);
+    renderThread_.resume();
+
+    if (!built) {
+        QMessageBox::information(this, tr("Warning"), 
+            tr("Failed to build the acceleration structure"));
+        accelerationCombo->setCurrentIndex(sceneData_.getAccelerationStructure());
+        return;
+    }
+
+    glWidget->redraw();
+}
+
+void MainWindow::progressiveRenderingChecked(bool state)
+{
+    glWidget->setProgressiveRendering(state);
+}
+
+void MainWindow::lightAngleChanged(int degrees)
+{
+    // Turns the default light around the vertical axis of the camera
+    glm::dmat4 rotationMatrix = glm::rotate(glm::dmat4(1.0), glm::radians(double(degrees)), glm::dvec3(0.0, 1.0, 0.0));
+    glm::dvec3 lightPos = glm::dvec3(rotationMatrix * 
+        glm::dvec4(kDefaultLightPosX, kDefaultLightPosY, kDefaultLightPosZ, 1.0));
+
+    // Just the light changes, so the render thread shades the last frame again instead of tracing it
+    renderThread_.pause();
+    sceneData_.setLightPos(lightPos);
+    renderThread_.resume();
+
+    glWidget->redraw();
+}
+
+void MainWindow::temporalReprojectionChecked(bool state)
+{
+    glWidget->setTemporalReprojection(state);
+}
+
+void MainWindow::costHeatmapChecked(bool state)
+{
+    glWidget->setCostHeatmap(state);
+}
+
+void MainWindow::treeCacheChecked(bool state)
 {
-    rayTracer_.setAntiAliasing(state);
-    glWidget->repaint();
+    // The trees built once are mapped from the cache after that, so changing the levels is quick.
+    // Only the scene built on this thread uses the directory, the render thread can go on.
+    sceneData_.setTreeCacheDirectory(state ? QStandardPaths::writableLocation(QStandardPaths::CacheLocation) : QString());
 }
@@ -7,11 +7,15 @@
 
 #include "camera.h"
 #include "raytracer.h"
+#include "renderthread.h"
 #include "scenedata.h"
+#include "threadpool.h"
 
 class GLWidget;
 class QCheckBox;
+class QComboBox;
 class QLabel;
+class QSlider;
 class QSpinBox;
 
 class MainWindow : public QMainWindow
@@ -24,7 +28,13 @@ public:
 private slots:
     void cameraMoved(); 
     void createSceneStructure(int levels);
-    void antiAliasingChecked(bool state);
+    void antiAliasingModeChanged(int index);
+    void accelerationStructureChanged(int index);
+    void progressiveRenderingChecked(bool state);
+    void temporalReprojectionChecked(bool state);
+    void costHeatmapChecked(bool state);
+    void treeCacheChecked(bool state);
+    void lightAngleChanged(int degrees);
     
 private:
     GLWidget *glWidget;
@@ -32,11 +42,21 @@ private:
     QLabel *cameraRotationLbl;
     QLabel *spheresCountLbl;
     QSpinBox *levelsSpin;
-    QCheckBox *antiAliasingCheckbox;
+    QComboBox *antiAliasingCombo;
+    QComboBox *accelerationCombo;
+    QCheckBox *progressiveRenderingCheckbox;
+    QCheckBox *temporalReprojectionCheckbox;
+    QCheckBox *costHeatmapCheckbox;
+    QCheckBox *treeCacheCheckbox;
+    QSlider *lightAngleSlider;
 
+    // Created first and shared by everybody that runs in parallel
+    MyRaytracer::ThreadPool threadPool_;
     MyRaytracer::Camera camera_;
     MyRaytracer::RayTracer rayTracer_;
     MyRaytracer::SceneData sceneData_;
+    // Destroyed first, so it stops rendering before the scene is gone
+    RenderThread renderThread_;
        
     void setupWidgets();
 };
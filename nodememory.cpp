@@ -0,0 +1,143 @@
+#include <QDebug>
+
+#include <new>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "nodememory.h"
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        // The size of the huge pages (x86-64 and the default on most other systems)
+        const size_t kHugePageSize = 2 * 1024 * 1024;
+        // The biggest NUMA node number the interleaving supports
+        const unsigned long kMaxNumaNodes = 1024;
+
+        size_t roundUp(size_t size, size_t alignment)
+        {
+            return (size + alignment - 1) / alignment * alignment;
+        }
+
+#ifdef __linux__
+        // Interleaves the pages of a range over all the NUMA nodes we are allowed to use. It has to be done
+        // before the pages are touched. The system calls are used directly to avoid depending on libnuma.
+        void interleaveNumaNodes(void *memory, size_t size)
+        {
+            const unsigned long kBitsPerWord = 8 * sizeof(unsigned long);
+            unsigned long nodeMask[kMaxNumaNodes / kBitsPerWord] = {};
+
+            int mode;
+            if (syscall(SYS_get_mempolicy, &mode, nodeMask, kMaxNumaNodes, nullptr, MPOL_F_MEMS_ALLOWED) != 0) {
+                qDebug() << "Failed to get the NUMA nodes, the tree is not interleaved";
+                return;
+            }
+
+            unsigned int nodesCount = 0;
+            for (unsigned long node = 0; node < kMaxNumaNodes; node++)
+                nodesCount += (nodeMask[node / kBitsPerWord] >> (node % kBitsPerWord)) & 1;
+            // Nothing to spread the pages over
+            if (nodesCount < 2)
+                return;
+
+            if (syscall(SYS_mbind, memory, size, MPOL_INTERLEAVE, nodeMask, kMaxNumaNodes, 0) != 0)
+                qDebug() << "Failed to interleave the tree over the NUMA nodes";
+            else
+                qDebug() << "The tree is interleaved over" << nodesCount << "NUMA nodes";
+        }
+#endif
+    }
+
+    bool NodeMemory::allocate(size_t size, unsigned int flags)
+    {
+        release();
+
+        if (flags != kDefaultNodeMemory && map(size, flags))
+            return true;
+
+        memory_ = new (std::nothrow) unsigned char[size];
+        if (memory_ == nullptr)
+            return false;
+
+        size_ = size;
+        mapped_ = false;
+        return true;
+    }
+
+    void NodeMemory::release()
+    {
+        if (!memory_)
+            return;
+
+#ifdef __linux__
+        if (mapped_)
+            munmap(memory_, size_);
+        else
+#endif
+            delete [] memory_;
+
+        memory_ = nullptr;
+        size_ = 0;
+        mapped_ = false;
+    }
+
+    bool NodeMemory::map(size_t size, unsigned int flags)
+    {
+#ifdef __linux__
+        void *memory = MAP_FAILED;
+        size_t mappedSize = size;
+
+        if (flags & kExplicitHugePages) {
+            mappedSize = roundUp(size, kHugePageSize);
+            memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory == MAP_FAILED)
+                qDebug() << "Not enough reserved huge pages for the tree, using the normal pages";
+        }
+
+        if (memory == MAP_FAILED && (flags & kTransparentHugePages)) {
+            // The transparent huge pages are used only for the 2 MB aligned parts of a mapping,
+            // so a bit more is mapped and cut down to an aligned range
+            mappedSize = roundUp(size, kHugePageSize);
+            void *unaligned = mmap(nullptr, mappedSize + kHugePageSize, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (unaligned != MAP_FAILED) {
+                size_t head = roundUp(reinterpret_cast<size_t>(unaligned), kHugePageSize) - reinterpret_cast<size_t>(unaligned);
+                if (head > 0)
+                    munmap(unaligned, head);
+                if (kHugePageSize - head > 0)
+                    munmap(static_cast<unsigned char *>(unaligned) + head + mappedSize, kHugePageSize - head);
+                memory = static_cast<unsigned char *>(unaligned) + head;
+
+                if (madvise(memory, mappedSize, MADV_HUGEPAGE) != 0)
+                    qDebug() << "Transparent huge pages are not available for the tree";
+            }
+        }
+
+        if (memory == MAP_FAILED) {
+            mappedSize = size;
+            memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+                return false;
+        }
+
+        if (flags & kInterleaveNumaNodes)
+            interleaveNumaNodes(memory, mappedSize);
+
+        memory_ = static_cast<unsigned char *>(memory);
+        size_ = mappedSize;
+        mapped_ = true;
+        return true;
+#else
+        // Just the heap memory elsewhere
+        (void)size;
+        (void)flags;
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef NODEMEMORY_H
+#define NODEMEMORY_H
+
+#include <cstddef>
+
+namespace MyRaytracer
+{
+    // How the memory of the sphereflake tree is allocated, the flags can be combined
+    enum NodeMemoryFlags
+    {
+        // Plain heap memory
+        kDefaultNodeMemory = 0,
+        // Asks the kernel to back the memory with transparent huge pages (2 MB on x86-64).
+        // The traversals jump all over the big trees, with huge pages they miss the TLB much less.
+        kTransparentHugePages = 1,
+        // Takes the huge pages reserved upfront (vm.nr_hugepages). If there are not enough
+        // of them the normal pages are used (transparent huge pages if they are asked for too).
+        kExplicitHugePages = 2,
+        // Spreads the pages evenly over the NUMA nodes, so that the threads on every socket
+        // get the same latency on average instead of all the nodes being on one socket
+        kInterleaveNumaNodes = 4
+    };
+
+    // A block of memory for the node arrays allocated the way the NodeMemoryFlags ask.
+    // The flags are just hints - if the system doesn't support something it's skipped.
+    class NodeMemory
+    {
+    public:
+        NodeMemory() : memory_(nullptr), size_(0), mapped_(false) {}
+        ~NodeMemory() { release(); }
+
+        // Allocates at least size bytes, frees what was there before. Returns false if we run out of memory.
+        bool allocate(size_t size, unsigned int flags);
+        void release();
+
+        unsigned char *data() const { return memory_; }
+
+    private:
+        // Disables copying and assigning
+        NodeMemory &operator=(const NodeMemory &);
+        NodeMemory(const NodeMemory &);
+
+        // Maps anonymous memory with the flags, used for everything but the plain heap memory
+        bool map(size_t size, unsigned int flags);
+
+        unsigned char *memory_;
+        // The size of the mapping, it can be rounded up to whole huge pages
+        size_t size_;
+        // Comes from mmap rather than from the heap
+        bool mapped_;
+    };
+}
+
+#endif //NODEMEMORY_H
@@ -0,0 +1,53 @@
+#include <QStringList>
+
+#include "nodememory.h"
+#include "optionparsing.h"
+
+namespace MyRaytracer
+{
+    bool parseSize(const QString &text, unsigned int &width, unsigned int &height)
+    {
+        QStringList parts = text.split('x');
+        if (parts.size() != 2)
+            return false;
+
+        bool widthOk, heightOk;
+        width = parts[0].toUInt(&widthOk);
+        height = parts[1].toUInt(&heightOk);
+        return widthOk && heightOk && width > 0 && height > 0;
+    }
+
+    bool parseAccelerationStructure(const QString &text, AccelerationStructure &accelerationStructure)
+    {
+        if (text == "tree")
+            accelerationStructure = kSkipListTree;
+        else if (text == "bvh4")
+            accelerationStructure = kWideBVH4;
+        else if (text == "bvh8")
+            accelerationStructure = kWideBVH8;
+        else if (text == "procedural")
+            accelerationStructure = kProceduralInstances;
+        else
+            return false;
+
+        return true;
+    }
+
+    bool parseNodeMemoryFlags(const QString &text, unsigned int &flags)
+    {
+        flags = kDefaultNodeMemory;
+        QStringList parts = text.split(',');
+        for (const QString &flag : parts) {
+            if (flag == "thp")
+                flags |= kTransparentHugePages;
+            else if (flag == "hugetlb")
+                flags |= kExplicitHugePages;
+            else if (flag == "interleave")
+                flags |= kInterleaveNumaNodes;
+            else if (flag != "default")
+                return false;
+        }
+
+        return true;
+    }
+}
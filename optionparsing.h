@@ -0,0 +1,21 @@
+#ifndef OPTIONPARSING_H
+#define OPTIONPARSING_H
+
+#include <QString>
+
+#include "scenedata.h"
+
+namespace MyRaytracer
+{
+    // Parsers of the command line options the command line tools have in common.
+    // They return false if the text is not valid.
+
+    // Parses a "<width>x<height>" size
+    bool parseSize(const QString &text, unsigned int &width, unsigned int &height);
+    // Parses tree, bvh4, bvh8 or procedural
+    bool parseAccelerationStructure(const QString &text, AccelerationStructure &accelerationStructure);
+    // Parses a comma separated list of the ways to allocate the tree (NodeMemoryFlags)
+    bool parseNodeMemoryFlags(const QString &text, unsigned int &flags);
+}
+
+#endif //OPTIONPARSING_H
@@ -1,51 +1,255 @@
 #ifndef RAYTRACER_H
 #define RAYTRACER_H
 
+#include <vector>
+
 #include <glm/fwd.hpp>
 #include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
 
 #include "asyncrunner.h"
 #include "settings.h"
+#include "spherekernels.h"
+#include "traversalstats.h"
 
 namespace MyRaytracer
 {
+    class CancellationToken;
+    struct Intersection;
     struct Ray;
     class SceneData;
+    class ThreadPool;
+
+    enum AntiAliasingMode
+    {
+        kNoAntiAliasing,
+        // 4 samples for every pixel
+        kFullAntiAliasing,
+        // A single sample for every pixel first and 4 samples just for the pixels
+        // that differ from their neighbours (the edges of the spheres mostly)
+        kAdaptiveAntiAliasing
+    };
+
+    // Marks the pixels whose primary ray hit nothing
+    const SphereIndex kNoSphere = ~SphereIndex(0);
+
+    // What the primary rays of a frame hit, an entry per pixel going row by row from the top.
+    // The points are in scene space and the depths are the distances from the camera.
+    // The pixels that hit nothing have kNoSphere for a sphere and an infinite depth.
+    struct GeometryBuffer
+    {
+        std::vector<glm::dvec3> points;
+        std::vector<glm::dvec3> normals;
+        std::vector<SphereIndex> sphereIdxs;
+        std::vector<double> depths;
+    };
+
+    // Returns the false color (RGB from 0 to 1) of a frame buffer value with the cost heatmap on.
+    // Goes from blue for the cheapest pixels through cyan, green and yellow to red.
+    glm::dvec3 heatmapColor(unsigned char value);
 
     class RayTracer
     {
     public:
-        RayTracer(SceneData &sceneData);
+        RayTracer(SceneData &sceneData, ThreadPool &threadPool);
 
-        void setFrameBuffer(uchar *frameBuffer) { frameBuffer_ = frameBuffer; }
-        void setAntiAliasing(bool antiAliasingEnabled) { antiAliasingEnabled_ = antiAliasingEnabled; }
+        // Sets the buffer the frames are rendered in, one byte per pixel. bytesPerLine is
+        // the distance between the rows of the buffer, 0 if they are right after each other.
+        void setFrameBuffer(unsigned char *frameBuffer, unsigned int bytesPerLine = 0) 
+        { 
+            frameBuffer_ = frameBuffer; 
+            frameBytesPerLine_ = bytesPerLine; 
+        }
+        // Sets the size in pixels of the frames, the frame buffer should be big enough for it
+        void setFrameSize(unsigned int width, unsigned int height);
+        unsigned int getFrameWidth() const { return frameWidth_; }
+        unsigned int getFrameHeight() const { return frameHeight_; }
+        void setAntiAliasingMode(AntiAliasingMode antiAliasingMode) { antiAliasingMode_ = antiAliasingMode; }
+        AntiAliasingMode getAntiAliasingMode() const { return antiAliasingMode_; }
         void setZoomLevel(int zoomLevel) { zoomLevel_ = zoomLevel; }
+        // Sets the camera (scene to camera space transformation). The primary rays
+        // are transformed to scene space instead of moving the whole scene to the camera.
+        void setViewMatrix(const glm::dmat4 &viewMatrix);
+        // Sets the size of the square screen tiles handed out to the rendering threads
+        void setTileSize(unsigned int tileSize) { tileSize_ = tileSize > 0 ? tileSize : 1; }
+        unsigned int getTileSize() const { return tileSize_; }
+        // Sets the size of the square blocks of pixels traced as a single packet of rays.
+        // Supported are 1 (every ray on its own), 2, 4 and 8.
+        void setPacketSize(unsigned int packetSize);
+        unsigned int getPacketSize() const { return packetSize_; }
+
+        // With temporal reprojection the hits of the previous frame are moved to where they are seen from the
+        // new camera. A pixel that gets a hit from the same sphere as its neighbours is intersected just with
+        // that sphere instead of tracing the whole scene. This makes small camera moves much faster, but it
+        // may miss a small sphere that moves in front of a big one. Used only without full anti-aliasing.
+        void setTemporalReprojection(bool enabled) { temporalReprojectionEnabled_ = enabled; }
+        bool getTemporalReprojection() const { return temporalReprojectionEnabled_; }
+
+        // With the geometry buffer enabled traceFrame keeps what every pixel hit, so that a change of the
+        // light can be shaded without tracing the frame again. Not filled with full anti-aliasing.
+        void setGeometryBufferEnabled(bool enabled) { geometryBufferEnabled_ = enabled; }
+        bool getGeometryBufferEnabled() const { return geometryBufferEnabled_; }
+        // Valid after traceFrame finishes a frame with the geometry buffer enabled
+        const GeometryBuffer &getGeometryBuffer() const { return geometryBuffer_; }
 
-        // Renders a frame and puts the output in frameBuffer
-        void traceFrame();
+        // With the traversal statistics enabled every ray is traced on its own (no packets) and what the
+        // traversals do is counted by every rendering thread. It makes the frames a bit slower.
+        void setTraversalStatsEnabled(bool enabled) { traversalStatsEnabled_ = enabled; }
+        bool getTraversalStatsEnabled() const { return traversalStatsEnabled_; }
+        // The statistics of the last frame summed up over the threads
+        TraversalStats getFrameTraversalStats() const;
+        // The statistics of the last frame of every pool worker, the last entry is for the thread calling traceFrame
+        std::vector<TraversalStats> getThreadTraversalStats() const;
+
+        // With the cost heatmap the frame buffer gets how expensive every pixel was instead of its shade - 
+        // the bound and sphere tests of its rays on a logarithmic scale (see heatmapColor for the colors).
+        // The statistics are counted then too. The previous frames are never reused for the heatmap.
+        void setCostHeatmapEnabled(bool enabled) { costHeatmapEnabled_ = enabled; }
+        bool getCostHeatmapEnabled() const { return costHeatmapEnabled_; }
+
+        // Once the token is cancelled the frame being rendered is abandoned after the tiles in progress
+        void setCancellationToken(const CancellationToken *cancellationToken) { cancellationToken_ = cancellationToken; }
+
+        // Renders a frame and puts the output in frameBuffer.
+        // Returns false if it was cancelled and the frame buffer is left half done.
+        bool traceFrame();
+        // Renders a coarse version of the frame quickly - a single ray without anti-aliasing
+        // for every pixelStep x pixelStep block of pixels. Used while the camera is moving.
+        bool tracePreviewFrame(unsigned int pixelStep);
+        // Shades the last frame again from its geometry buffer, picking up the current light position.
+        // Just the edges are traced again with adaptive anti-aliasing. Returns false if the frame can't
+        // be done that way - there's no geometry buffer for the current camera, frame size and scene, 
+        // or full anti-aliasing or the cost heatmap is on. The frame buffer is left alone then. Also false if cancelled.
+        bool reshadeFrame();
 
     private:
+        // What the rendering threads do with the tiles
+        enum RenderPass
+        {
+            // Render the final pixels straight away
+            kFinalPass,
+            // Trace a single ray per pixel and keep what it hit (adaptive anti-aliasing)
+            kPrimaryRaysPass,
+            // Supersample the pixels that differ from their neighbours (adaptive anti-aliasing)
+            kEdgesPass,
+            // Shade the primary rays again from the geometry buffer
+            kReshadePass,
+            // A ray per block of pixels
+            kPreviewPass
+        };
+
         // Functor that allows the parallelisation of rendering a frame
         struct RayTraceParallelTask
         {
         public:
             RayTraceParallelTask(RayTracer& outer) : outer_(outer) {}
-            // Traverse the range of pixels passed and does a ray trace for each of them
-            void operator()(unsigned int taskPixelStartIdx, unsigned int taskPixelEndIdx);
+            // Traverse the range of tiles passed and does a ray trace for each of their pixels
+            void operator()(unsigned int taskTileStartIdx, unsigned int taskTileEndIdx);
             
         private:
+            // Calculates the final intensity of a single pixel
+            double tracePixel(int x, int y);
+            // Calculates the final intensity of a block of pixels tracing their rays as packets
+            void tracePacket(unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY);
+            // Traces the rays through the centers of a block of pixels and keeps their intensities and spheres
+            void tracePrimaryRays(unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY);
+            // Finishes the pixels of a tile, supersampling just the ones at the edges
+            void traceEdges(unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY);
+            // Calculates the final intensity of up to kMaxPacketSize / 4 pixels taking 4 samples for each one
+            void traceSupersampledPixels(const unsigned int *xs, const unsigned int *ys, unsigned int pixelsCount);
+            // Calculates the intensities of a number of rays and what they hit (if intersections is not null,
+            // the rays that hit nothing get kNoSphere). Uses packets of rays if they are enabled.
+            void traceRays(const Ray *rays, unsigned int raysCount, double *intensities, Intersection *intersections);
+            // Traces the primary ray of a pixel just against the sphere reprojected from the previous frame.
+            // Returns false if the pixel can't be done that way.
+            bool traceReprojectedPixel(unsigned int x, unsigned int y, const Ray &ray);
+            // Keeps the result of the primary ray of a pixel
+            void storePrimaryHit(unsigned int x, unsigned int y, double intensity, const Intersection &intersection);
+            // Shades the primary rays of a tile again from the geometry buffer
+            void reshadePrimaryRays(unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY);
+            // Renders the preview blocks that start in a tile
+            void tracePreview(unsigned int startX, unsigned int startY, unsigned int endX, unsigned int endY);
+            // Traces the rays of up to kMaxPacketSize preview blocks and fills the blocks
+            void tracePreviewBlocks(const unsigned int *xs, const unsigned int *ys, unsigned int blocksCount);
+            // Checks if the primary ray of a pixel differs from the ones of its neighbours
+            bool isEdgePixel(unsigned int x, unsigned int y) const;
             // Calculates the intensity of a specific ray
             double rayTrace(const Ray &ray);
+            // Calculates the intensity of a ray and finds what it hits (kNoSphere if nothing).
+            // Counts the traversal and gives its cost instead of the intensity if that's asked for.
+            double rayTrace(const Ray &ray, Intersection &intersection);
+            // Calculates the intensity of a surface point
+            double shade(const Intersection &intersection) const;
+            // Returns the direction in scene space of a ray going through a point of the screen
+            glm::dvec3 primaryRayDirection(double x, double y) const;
+            // Returns where a pixel is in the frame buffer. The rows are stored bottom up.
+            unsigned char &framePixel(unsigned int x, unsigned int y) const;
 
             RayTracer &outer_;
         };
         AsyncRunner<RayTraceParallelTask> parallelRaytraceRunner_;
 
+        // Moves the camera and the light to scene space for the next frame
+        void prepareFrame();
+        // Returns the number of tiles the frame is split into
+        unsigned int getTilesCount() const;
+        // Moves the hits of the previous frame to the pixels they are seen through now
+        void reprojectPreviousFrame();
+        // Checks if the geometry buffer has the frame that is about to be rendered
+        bool isGeometryBufferCurrent() const;
+
+        // The statistics of the threads are kept a cache line apart, so that the threads don't write to the same one
+        struct ThreadTraversalStats
+        {
+            TraversalStats stats;
+            unsigned char padding[64];
+        };
+
         SceneData &sceneData_;
-        uchar *frameBuffer_;
-        bool antiAliasingEnabled_;
+        ThreadPool &threadPool_;
+        const CancellationToken *cancellationToken_;
+        unsigned char *frameBuffer_;
+        unsigned int frameWidth_;
+        unsigned int frameHeight_;
+        unsigned int frameBytesPerLine_;
+        // The inverse of the view matrix and what it gives for the current frame
+        glm::dmat4 cameraToSceneMatrix_;
+        glm::dmat3 cameraToSceneRotation_;
+        glm::dvec3 sceneCameraPos_;
+        glm::dvec3 sceneLightPos_;
+        AntiAliasingMode antiAliasingMode_;
+        RenderPass renderPass_;
+        unsigned int previewPixelStep_;
+        // The intensities of the primary rays pass, one per pixel
+        std::vector<double> primaryIntensities_;
+        // What the primary rays pass hit. The normals and the depths are kept only if the buffer is enabled.
+        GeometryBuffer geometryBuffer_;
+        bool geometryBufferEnabled_;
+        // The frame the geometry buffer is for. Complete means it has all the fields.
+        bool geometryBufferValid_;
+        bool geometryBufferComplete_;
+        unsigned int geometryBufferWidth_;
+        unsigned int geometryBufferHeight_;
+        unsigned int geometryBufferSceneVersion_;
+        int geometryBufferZoomLevel_;
+        glm::dmat4 geometryBufferCameraToSceneMatrix_;
+        // The temporal reprojection of the previous frame
+        bool temporalReprojectionEnabled_;
+        bool reprojectionAvailable_;
+        std::vector<SphereIndex> reprojectedSphereIdxs_;
+        std::vector<double> reprojectedDepths_;
         int zoomLevel_;
+        unsigned int tileSize_;
+        unsigned int packetSize_;
         glm::dvec2 samplesGridDeltas_[4];
+        bool traversalStatsEnabled_;
+        bool costHeatmapEnabled_;
+        // Set for the frame being rendered if either of the above is
+        bool countingTraversals_;
+        // An entry per pool worker and one for the thread outside the pool
+        std::vector<ThreadTraversalStats> threadTraversalStats_;
     };
 }
 
@@ -1,4 +1,7 @@
-#include <QImage>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include <QDebug>
 
 #include <glm/glm.hpp>
@@ -6,15 +9,40 @@
 
 #include "raytracer.h"
 #include "scenedata.h"
+#include "threadpool.h"
 
 namespace MyRaytracer
 {
-    RayTracer::RayTracer(SceneData &sceneData) : 
+    RayTracer::RayTracer(SceneData &sceneData, ThreadPool &threadPool) : 
+        parallelRaytraceRunner_(RayTraceParallelTask(*this), threadPool),
         sceneData_(sceneData),
-        antiAliasingEnabled_(true),
-        zoomLevel_(100),
+        threadPool_(threadPool),
+        cancellationToken_(nullptr),
         frameBuffer_(nullptr),
-        parallelRaytraceRunner_(*this)
+        frameWidth_(kDefaultSceneWidth),
+        frameHeight_(kDefaultSceneHeight),
+        frameBytesPerLine_(0),
+        cameraToSceneMatrix_(1.0),
+        antiAliasingMode_(kFullAntiAliasing),
+        renderPass_(kFinalPass),
+        previewPixelStep_(1),
+        geometryBufferEnabled_(false),
+        geometryBufferValid_(false),
+        geometryBufferComplete_(false),
+        geometryBufferWidth_(0),
+        geometryBufferHeight_(0),
+        geometryBufferSceneVersion_(0),
+        geometryBufferZoomLevel_(0),
+        geometryBufferCameraToSceneMatrix_(1.0),
+        temporalReprojectionEnabled_(false),
+        reprojectionAvailable_(false),
+        zoomLevel_(100),
+        tileSize_(kDefaultTileSize),
+        packetSize_(kDefaultPacketSize),
+        traversalStatsEnabled_(false),
+        costHeatmapEnabled_(false),
+        countingTraversals_(false),
+        threadTraversalStats_(threadPool.getThreadsCount() + 1)
     {
         samplesGridDeltas_[0] =  glm::dvec2(-0.3, -0.3);
         samplesGridDeltas_[1] =  glm::dvec2(+0.3, -0.3);
@@ -22,68 +50,680 @@ namespace MyRaytracer
         samplesGridDeltas_[3] =  glm::dvec2(+0.3, +0.3);
     }
 
-    double RayTracer::RayTraceParallelTask::rayTrace(const Ray &ray)
+    glm::dvec3 heatmapColor(unsigned char value)
+    {
+        // Four equal steps between the five colors
+        double position = value / 255.0 * 4;
+        double inStep = position - floor(position);
+        switch ((int)position) {
+            case 0: return glm::dvec3(0, inStep, 1);
+            case 1: return glm::dvec3(0, 1, 1 - inStep);
+            case 2: return glm::dvec3(inStep, 1, 0);
+            case 3: return glm::dvec3(1, 1 - inStep, 0);
+            default: return glm::dvec3(1, 0, 0);
+        }
+    }
+
+    void RayTracer::setViewMatrix(const glm::dmat4 &viewMatrix)
+    {
+        cameraToSceneMatrix_ = glm::inverse(viewMatrix);
+    }
+
+    void RayTracer::setFrameSize(unsigned int width, unsigned int height)
+    {
+        frameWidth_ = width > 0 ? width : 1;
+        frameHeight_ = height > 0 ? height : 1;
+    }
+
+    void RayTracer::setPacketSize(unsigned int packetSize)
+    {
+        // A packet can't have more rays than SceneData::getIntersections accepts
+        packetSize_ = 1;
+        while (packetSize_ * 2 <= packetSize && (packetSize_ * 2) * (packetSize_ * 2) <= SceneData::kMaxPacketSize)
+            packetSize_ *= 2;
+    }
+
+    double RayTracer::RayTraceParallelTask::shade(const Intersection &intersection) const
     {
-        double shade = 0;
+        glm::dvec3 lightVector = glm::normalize(outer_.sceneLightPos_ - intersection.point);
+        double shade = glm::dot(lightVector, intersection.surfaceNormal);
+        // Put some ambient light in all cases
+        if (shade < 0)
+            shade = 0.2 * (1 + shade);
+        else 
+            shade = (0.2 + 0.8 * shade);
+
+        return shade;
+    }
 
+    double RayTracer::RayTraceParallelTask::rayTrace(const Ray &ray)
+    {
         Intersection intersection;
-        glm::dvec3 lightPos = outer_.sceneData_.lightPos();
+        return rayTrace(ray, intersection);
+    }
 
-        if (outer_.sceneData_.getIntersection(ray, intersection)) {
-            glm::dvec3 lightVector = glm::normalize(lightPos - intersection.point);
-            shade = glm::dot(lightVector, intersection.surfaceNormal);
-            // Put some ambient light in all cases
-            if (shade < 0)
-                shade = 0.2 * (1 + shade);
-            else 
-                shade = (0.2 + 0.8 * shade);
+    double RayTracer::RayTraceParallelTask::rayTrace(const Ray &ray, Intersection &intersection)
+    {
+        if (!outer_.countingTraversals_) {
+            if (outer_.sceneData_.getIntersection(ray, intersection))
+                return shade(intersection);
+
+            intersection.sphereIdx = kNoSphere;
+            return 0;
         }
 
-        return shade;
+        TraversalStats rayStats;
+        bool hit = outer_.sceneData_.getIntersection(ray, intersection, rayStats);
+        if (!hit)
+            intersection.sphereIdx = kNoSphere;
+        outer_.threadTraversalStats_[outer_.threadPool_.getCurrentWorkerIndex()].stats.add(rayStats);
+
+        if (outer_.costHeatmapEnabled_) {
+            // The tests are what the traversal spends its time on. The scale is logarithmic, the
+            // expensive rays cost orders of magnitude more than the ones that miss right away.
+            double cost = double(rayStats.boundTests + rayStats.sphereTests);
+            return std::min(log2(1 + cost) / log2(1 + kHeatmapMaxCost), 255 / 256.0);
+        }
+
+        return hit ? shade(intersection) : 0;
     }
 
-    void RayTracer::RayTraceParallelTask::operator()(unsigned int taskPixelStartIdx, 
-                                                     unsigned int taskPixelEndIdx)
+    glm::dvec3 RayTracer::RayTraceParallelTask::primaryRayDirection(double x, double y) const
     {
-        // Find out the first pixel in the range this task is responsible for
-        int y = taskPixelStartIdx / kSceneWidth;
-        int x = taskPixelStartIdx - y * kSceneWidth;
+        // All the rays start from the camera, their directions are rotated to scene space
+        return glm::normalize(outer_.cameraToSceneRotation_ * 
+                              glm::dvec3(x - outer_.frameWidth_ / 2, y - outer_.frameHeight_ / 2, outer_.zoomLevel_));
+    }
+
+    unsigned char &RayTracer::RayTraceParallelTask::framePixel(unsigned int x, unsigned int y) const
+    {
+        size_t bytesPerLine = outer_.frameBytesPerLine_ > 0 ? outer_.frameBytesPerLine_ : outer_.frameWidth_;
+        return outer_.frameBuffer_[(outer_.frameHeight_ - 1 - y) * bytesPerLine + x];
+    }
+
+    double RayTracer::RayTraceParallelTask::tracePixel(int x, int y)
+    {
+        double intensity = 0;
 
         Ray ray;
-        ray.origin = glm::dvec3(0, 0, 0);
+        ray.origin = outer_.sceneCameraPos_;
+
+        if (outer_.antiAliasingMode_ == kFullAntiAliasing) {
+            // Take 4 samples for better anti-aliasing
+            for (int s = 0; s < 4; s++) {
+                ray.direction = primaryRayDirection(outer_.samplesGridDeltas_[s].x + x, outer_.samplesGridDeltas_[s].y + y);
+                intensity += rayTrace(ray);
+            }
+            intensity = intensity / 4;
+        } else {
+            // Take just one sample, going straight to the pixel
+            ray.direction = primaryRayDirection(x, y);
+            intensity = rayTrace(ray);
+        }
+
+        return intensity;
+    }
+
+    void RayTracer::RayTraceParallelTask::tracePacket(unsigned int startX, unsigned int startY, 
+                                                      unsigned int endX, unsigned int endY)
+    {
+        Ray rays[SceneData::kMaxPacketSize];
+        Intersection intersections[SceneData::kMaxPacketSize];
+        bool hits[SceneData::kMaxPacketSize];
+        double intensities[SceneData::kMaxPacketSize];
+
+        unsigned int blockWidth = endX - startX;
+        unsigned int raysCount = blockWidth * (endY - startY);
+
+        for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+            rays[rayIdx].origin = outer_.sceneCameraPos_;
+            intensities[rayIdx] = 0;
+        }
+
+        // Every anti-aliasing sample is a separate packet, the rays of a packet go
+        // through the same spot of neighbouring pixels
+        bool antiAliasingEnabled = outer_.antiAliasingMode_ == kFullAntiAliasing;
+        unsigned int samplesCount = antiAliasingEnabled ? 4 : 1;
+        for (unsigned int s = 0; s < samplesCount; s++) {
+            glm::dvec2 sampleDelta = antiAliasingEnabled ? outer_.samplesGridDeltas_[s] : glm::dvec2(0, 0);
+
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                unsigned int x = startX + rayIdx % blockWidth;
+                unsigned int y = startY + rayIdx / blockWidth;
+                rays[rayIdx].direction = primaryRayDirection(sampleDelta.x + x, sampleDelta.y + y);
+            }
+
+            outer_.sceneData_.getIntersections(rays, raysCount, intersections, hits);
+
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                if (hits[rayIdx])
+                    intensities[rayIdx] += shade(intersections[rayIdx]);
+            }
+        }
+
+        for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+            unsigned int x = startX + rayIdx % blockWidth;
+            unsigned int y = startY + rayIdx / blockWidth;
+            framePixel(x, y) = 256 * (intensities[rayIdx] / samplesCount);
+        }
+    }
+
+    void RayTracer::RayTraceParallelTask::traceRays(const Ray *rays, unsigned int raysCount, 
+                                                    double *intensities, Intersection *intersections)
+    {
+        if (outer_.packetSize_ <= 1 || outer_.countingTraversals_) {
+            // One ray at a time, without the arrays of the packets which are expensive to set up for a single ray.
+            // The traversals are counted just for single rays.
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                Intersection intersection;
+                intensities[rayIdx] = rayTrace(rays[rayIdx], intersection);
+                if (intersections)
+                    intersections[rayIdx] = intersection;
+            }
+            return;
+        }
+
+        Intersection packetIntersections[SceneData::kMaxPacketSize];
+        bool hits[SceneData::kMaxPacketSize];
+
+        for (unsigned int firstRay = 0; firstRay < raysCount; firstRay += SceneData::kMaxPacketSize) {
+            unsigned int count = raysCount - firstRay;
+            if (count > SceneData::kMaxPacketSize)
+                count = SceneData::kMaxPacketSize;
+
+            outer_.sceneData_.getIntersections(rays + firstRay, count, packetIntersections, hits);
+
+            for (unsigned int rayIdx = 0; rayIdx < count; rayIdx++) {
+                intensities[firstRay + rayIdx] = hits[rayIdx] ? shade(packetIntersections[rayIdx]) : 0;
+                if (intersections) {
+                    intersections[firstRay + rayIdx] = packetIntersections[rayIdx];
+                    if (!hits[rayIdx])
+                        intersections[firstRay + rayIdx].sphereIdx = kNoSphere;
+                }
+            }
+        }
+    }
+
+    void RayTracer::RayTraceParallelTask::storePrimaryHit(unsigned int x, unsigned int y, double intensity,
+                                                          const Intersection &intersection)
+    {
+        size_t pixelIdx = size_t(y) * outer_.frameWidth_ + x;
+        GeometryBuffer &geometryBuffer = outer_.geometryBuffer_;
+        bool hit = intersection.sphereIdx != kNoSphere;
+
+        outer_.primaryIntensities_[pixelIdx] = intensity;
+        geometryBuffer.sphereIdxs[pixelIdx] = intersection.sphereIdx;
+        geometryBuffer.points[pixelIdx] = intersection.point;
+        if (outer_.geometryBufferEnabled_) {
+            geometryBuffer.normals[pixelIdx] = intersection.surfaceNormal;
+            geometryBuffer.depths[pixelIdx] = hit ? glm::length(intersection.point - outer_.sceneCameraPos_) : 
+                                                    std::numeric_limits<double>::infinity();
+        }
+
+        // Without anti-aliasing this is the final pixel
+        if (outer_.antiAliasingMode_ == kNoAntiAliasing)
+            framePixel(x, y) = 256 * intensity;
+    }
+
+    bool RayTracer::RayTraceParallelTask::traceReprojectedPixel(unsigned int x, unsigned int y, const Ray &ray)
+    {
+        const unsigned int width = outer_.frameWidth_;
+        const size_t pixelIdx = size_t(y) * width + x;
+        const std::vector<SphereIndex> &reprojectedSphereIdxs = outer_.reprojectedSphereIdxs_;
+
+        SphereIndex sphereIdx = reprojectedSphereIdxs[pixelIdx];
+        if (sphereIdx == kNoSphere)
+            return false;
+
+        // Next to another sphere or to a hole something new might show up, so such pixels are traced
+        // in full. Inside the area of a sphere we assume it's still the closest one.
+        if ((x > 0 && reprojectedSphereIdxs[pixelIdx - 1] != sphereIdx) ||
+            (x + 1 < width && reprojectedSphereIdxs[pixelIdx + 1] != sphereIdx) ||
+            (y > 0 && reprojectedSphereIdxs[pixelIdx - width] != sphereIdx) ||
+            (y + 1 < outer_.frameHeight_ && reprojectedSphereIdxs[pixelIdx + width] != sphereIdx))
+            return false;
+
+        Sphere sphere = outer_.sceneData_.getSphere(sphereIdx);
+        double t;
+        if (!sphere.intersects(ray, t))
+            return false;
+
+        Intersection intersection;
+        intersection.point = t * ray.direction + ray.origin;
+        intersection.surfaceNormal = (intersection.point - sphere.center) / sphere.radius;
+        intersection.sphereIdx = sphereIdx;
+        storePrimaryHit(x, y, shade(intersection), intersection);
+
+        return true;
+    }
+
+    void RayTracer::RayTraceParallelTask::tracePrimaryRays(unsigned int startX, unsigned int startY, 
+                                                           unsigned int endX, unsigned int endY)
+    {
+        Ray rays[SceneData::kMaxPacketSize];
+        unsigned int xs[SceneData::kMaxPacketSize];
+        unsigned int ys[SceneData::kMaxPacketSize];
+        double intensities[SceneData::kMaxPacketSize];
+        Intersection intersections[SceneData::kMaxPacketSize];
+
+        // The blocks are as big as the packets, so that their rays go together
+        const unsigned int blockSize = outer_.packetSize_;
+        for (unsigned int blockY = startY; blockY < endY; blockY += blockSize) {
+            for (unsigned int blockX = startX; blockX < endX; blockX += blockSize) {
+                unsigned int blockEndX = std::min(blockX + blockSize, endX);
+                unsigned int blockEndY = std::min(blockY + blockSize, endY);
+
+                // The pixels that can't reuse the previous frame are traced together
+                unsigned int raysCount = 0;
+                for (unsigned int y = blockY; y < blockEndY; y++) {
+                    for (unsigned int x = blockX; x < blockEndX; x++) {
+                        rays[raysCount].origin = outer_.sceneCameraPos_;
+                        rays[raysCount].direction = primaryRayDirection(x, y);
+                        if (outer_.reprojectionAvailable_ && traceReprojectedPixel(x, y, rays[raysCount]))
+                            continue;
+
+                        xs[raysCount] = x;
+                        ys[raysCount] = y;
+                        raysCount++;
+                    }
+                }
+
+                traceRays(rays, raysCount, intensities, intersections);
+
+                for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++)
+                    storePrimaryHit(xs[rayIdx], ys[rayIdx], intensities[rayIdx], intersections[rayIdx]);
+            }
+        }
+    }
+
+    void RayTracer::RayTraceParallelTask::reshadePrimaryRays(unsigned int startX, unsigned int startY, 
+                                                             unsigned int endX, unsigned int endY)
+    {
+        const GeometryBuffer &geometryBuffer = outer_.geometryBuffer_;
+        for (unsigned int y = startY; y < endY; y++) {
+            for (unsigned int x = startX; x < endX; x++) {
+                size_t pixelIdx = size_t(y) * outer_.frameWidth_ + x;
+
+                double intensity = 0;
+                if (geometryBuffer.sphereIdxs[pixelIdx] != kNoSphere) {
+                    Intersection intersection;
+                    intersection.point = geometryBuffer.points[pixelIdx];
+                    intersection.surfaceNormal = geometryBuffer.normals[pixelIdx];
+                    intersection.sphereIdx = geometryBuffer.sphereIdxs[pixelIdx];
+                    intensity = shade(intersection);
+                }
+
+                outer_.primaryIntensities_[pixelIdx] = intensity;
+                if (outer_.antiAliasingMode_ == kNoAntiAliasing)
+                    framePixel(x, y) = 256 * intensity;
+            }
+        }
+    }
+
+    bool RayTracer::RayTraceParallelTask::isEdgePixel(unsigned int x, unsigned int y) const
+    {
+        const unsigned int width = outer_.frameWidth_;
+        const unsigned int pixelIdx = y * width + x;
+
+        unsigned int neighbours[4];
+        unsigned int neighboursCount = 0;
+        if (x > 0)
+            neighbours[neighboursCount++] = pixelIdx - 1;
+        if (x + 1 < width)
+            neighbours[neighboursCount++] = pixelIdx + 1;
+        if (y > 0)
+            neighbours[neighboursCount++] = pixelIdx - width;
+        if (y + 1 < outer_.frameHeight_)
+            neighbours[neighboursCount++] = pixelIdx + width;
+
+        // A different sphere is an edge even if it happens to be lit the same way
+        for (unsigned int i = 0; i < neighboursCount; i++) {
+            if (outer_.geometryBuffer_.sphereIdxs[neighbours[i]] != outer_.geometryBuffer_.sphereIdxs[pixelIdx] ||
+                std::abs(outer_.primaryIntensities_[neighbours[i]] - outer_.primaryIntensities_[pixelIdx]) > 
+                    kAdaptiveAntiAliasingThreshold)
+                return true;
+        }
 
-        for (unsigned int pixelIdx = taskPixelStartIdx; pixelIdx <= taskPixelEndIdx; pixelIdx++) {
+        return false;
+    }
+
+    void RayTracer::RayTraceParallelTask::traceSupersampledPixels(const unsigned int *xs, const unsigned int *ys,
+                                                                  unsigned int pixelsCount)
+    {
+        Ray rays[SceneData::kMaxPacketSize];
+        double intensities[SceneData::kMaxPacketSize];
+
+        // The same samples the full anti-aliasing takes
+        for (unsigned int pixelIdx = 0; pixelIdx < pixelsCount; pixelIdx++) {
+            for (unsigned int s = 0; s < 4; s++) {
+                Ray &ray = rays[pixelIdx * 4 + s];
+                ray.origin = outer_.sceneCameraPos_;
+                ray.direction = primaryRayDirection(outer_.samplesGridDeltas_[s].x + xs[pixelIdx], 
+                                                    outer_.samplesGridDeltas_[s].y + ys[pixelIdx]);
+            }
+        }
+
+        traceRays(rays, pixelsCount * 4, intensities, nullptr);
+
+        for (unsigned int pixelIdx = 0; pixelIdx < pixelsCount; pixelIdx++) {
             double intensity = 0;
+            for (unsigned int s = 0; s < 4; s++)
+                intensity += intensities[pixelIdx * 4 + s];
+            framePixel(xs[pixelIdx], ys[pixelIdx]) = 256 * (intensity / 4);
+        }
+    }
+
+    void RayTracer::RayTraceParallelTask::traceEdges(unsigned int startX, unsigned int startY, 
+                                                     unsigned int endX, unsigned int endY)
+    {
+        // The edge pixels are gathered, so that their samples are traced together
+        const unsigned int kMaxEdgePixels = SceneData::kMaxPacketSize / 4;
+        unsigned int edgeXs[kMaxEdgePixels];
+        unsigned int edgeYs[kMaxEdgePixels];
+        unsigned int edgePixelsCount = 0;
+
+        for (unsigned int y = startY; y < endY; y++) {
+            for (unsigned int x = startX; x < endX; x++) {
+                if (!isEdgePixel(x, y)) {
+                    // The single sample is enough for the pixels like their neighbours
+                    framePixel(x, y) = 256 * outer_.primaryIntensities_[y * outer_.frameWidth_ + x];
+                    continue;
+                }
+
+                edgeXs[edgePixelsCount] = x;
+                edgeYs[edgePixelsCount] = y;
+                if (++edgePixelsCount == kMaxEdgePixels) {
+                    traceSupersampledPixels(edgeXs, edgeYs, edgePixelsCount);
+                    edgePixelsCount = 0;
+                }
+            }
+        }
+
+        if (edgePixelsCount > 0)
+            traceSupersampledPixels(edgeXs, edgeYs, edgePixelsCount);
+    }
+
+    void RayTracer::RayTraceParallelTask::tracePreviewBlocks(const unsigned int *xs, const unsigned int *ys, 
+                                                             unsigned int blocksCount)
+    {
+        Ray rays[SceneData::kMaxPacketSize];
+        double intensities[SceneData::kMaxPacketSize];
+
+        const unsigned int step = outer_.previewPixelStep_;
+        for (unsigned int blockIdx = 0; blockIdx < blocksCount; blockIdx++) {
+            // Through the middle of the block
+            rays[blockIdx].origin = outer_.sceneCameraPos_;
+            rays[blockIdx].direction = primaryRayDirection(xs[blockIdx] + (step - 1) / 2.0, ys[blockIdx] + (step - 1) / 2.0);
+        }
+
+        traceRays(rays, blocksCount, intensities, nullptr);
+
+        for (unsigned int blockIdx = 0; blockIdx < blocksCount; blockIdx++) {
+            unsigned int blockEndX = std::min(xs[blockIdx] + step, outer_.frameWidth_);
+            unsigned int blockEndY = std::min(ys[blockIdx] + step, outer_.frameHeight_);
+            unsigned char value = 256 * intensities[blockIdx];
+            for (unsigned int y = ys[blockIdx]; y < blockEndY; y++) {
+                for (unsigned int x = xs[blockIdx]; x < blockEndX; x++)
+                    framePixel(x, y) = value;
+            }
+        }
+    }
+
+    void RayTracer::RayTraceParallelTask::tracePreview(unsigned int startX, unsigned int startY, 
+                                                       unsigned int endX, unsigned int endY)
+    {
+        unsigned int blockXs[SceneData::kMaxPacketSize];
+        unsigned int blockYs[SceneData::kMaxPacketSize];
+        unsigned int blocksCount = 0;
+
+        // The blocks are aligned to the frame, not to the tile. A block belongs
+        // to the tile it starts in, even if it sticks out of it.
+        const unsigned int step = outer_.previewPixelStep_;
+        for (unsigned int y = (startY + step - 1) / step * step; y < endY; y += step) {
+            for (unsigned int x = (startX + step - 1) / step * step; x < endX; x += step) {
+                blockXs[blocksCount] = x;
+                blockYs[blocksCount] = y;
+                if (++blocksCount == SceneData::kMaxPacketSize) {
+                    tracePreviewBlocks(blockXs, blockYs, blocksCount);
+                    blocksCount = 0;
+                }
+            }
+        }
+
+        if (blocksCount > 0)
+            tracePreviewBlocks(blockXs, blockYs, blocksCount);
+    }
+
+    void RayTracer::RayTraceParallelTask::operator()(unsigned int taskTileStartIdx, 
+                                                     unsigned int taskTileEndIdx)
+    {
+        const unsigned int tileSize = outer_.tileSize_;
+        const unsigned int tilesPerRow = (outer_.frameWidth_ + tileSize - 1) / tileSize;
+
+        for (unsigned int tileIdx = taskTileStartIdx; tileIdx <= taskTileEndIdx; tileIdx++) {
+            // Find out the pixels covered by the tile, the ones on the right and bottom edge might be cut
+            unsigned int tileStartX = (tileIdx % tilesPerRow) * tileSize;
+            unsigned int tileStartY = (tileIdx / tilesPerRow) * tileSize;
+            unsigned int tileEndX = std::min(tileStartX + tileSize, outer_.frameWidth_);
+            unsigned int tileEndY = std::min(tileStartY + tileSize, outer_.frameHeight_);
+
+            if (outer_.renderPass_ == kPrimaryRaysPass) {
+                tracePrimaryRays(tileStartX, tileStartY, tileEndX, tileEndY);
+                continue;
+            }
+            if (outer_.renderPass_ == kEdgesPass) {
+                traceEdges(tileStartX, tileStartY, tileEndX, tileEndY);
+                continue;
+            }
+            if (outer_.renderPass_ == kReshadePass) {
+                reshadePrimaryRays(tileStartX, tileStartY, tileEndX, tileEndY);
+                continue;
+            }
+            if (outer_.renderPass_ == kPreviewPass) {
+                tracePreview(tileStartX, tileStartY, tileEndX, tileEndY);
+                continue;
+            }
+
+            if (outer_.packetSize_ > 1 && !outer_.countingTraversals_) {
+                const unsigned int packetSize = outer_.packetSize_;
+                for (unsigned int y = tileStartY; y < tileEndY; y += packetSize) {
+                    for (unsigned int x = tileStartX; x < tileEndX; x += packetSize) {
+                        tracePacket(x, y, std::min(x + packetSize, tileEndX), std::min(y + packetSize, tileEndY));
+                    }
+                }
+                continue;
+            }
 
-            if (outer_.antiAliasingEnabled_) {
-                // Take 4 samples for better anti-aliasing
-                for (int s = 0; s < 4; s++) {
-                    ray.direction = glm::normalize(glm::dvec3((double)(outer_.samplesGridDeltas_[s].x + x - kSceneWidth / 2),
-                                                              (double)(outer_.samplesGridDeltas_[s].y + y - kSceneHeight / 2),
-                                                              outer_.zoomLevel_));
-                    intensity += rayTrace(ray);
+            for (unsigned int y = tileStartY; y < tileEndY; y++) {
+                for (unsigned int x = tileStartX; x < tileEndX; x++) {
+                    double intensity = tracePixel(x, y);
+                    framePixel(x, y) = 256 * intensity;
                 }
-                intensity = intensity / 4;
-            } else {
-                // Take just one sample, going straight to the pixel
-                ray.direction = glm::normalize(glm::dvec3((double)(x - (int)kSceneWidth / 2),
-                                                          (double)(y - (int)kSceneHeight / 2),
-                                                          outer_.zoomLevel_));
-                intensity = rayTrace(ray);
             }
+        }
+    }
+
+    void RayTracer::prepareFrame()
+    {
+        // The light is attached to the camera, so it moves to scene space as well
+        cameraToSceneRotation_ = glm::dmat3(cameraToSceneMatrix_);
+        sceneCameraPos_ = glm::dvec3(cameraToSceneMatrix_ * glm::dvec4(0, 0, 0, 1));
+        sceneLightPos_ = glm::dvec3(cameraToSceneMatrix_ * glm::dvec4(sceneData_.lightPos(), 1));
+
+        countingTraversals_ = traversalStatsEnabled_ || costHeatmapEnabled_;
+        if (countingTraversals_) {
+            for (size_t threadIdx = 0; threadIdx < threadTraversalStats_.size(); threadIdx++)
+                threadTraversalStats_[threadIdx].stats = TraversalStats();
+        }
+    }
+
+    TraversalStats RayTracer::getFrameTraversalStats() const
+    {
+        TraversalStats frameStats;
+        for (size_t threadIdx = 0; threadIdx < threadTraversalStats_.size(); threadIdx++)
+            frameStats.add(threadTraversalStats_[threadIdx].stats);
+
+        return frameStats;
+    }
+
+    std::vector<TraversalStats> RayTracer::getThreadTraversalStats() const
+    {
+        std::vector<TraversalStats> threadStats;
+        for (size_t threadIdx = 0; threadIdx < threadTraversalStats_.size(); threadIdx++)
+            threadStats.push_back(threadTraversalStats_[threadIdx].stats);
+
+        return threadStats;
+    }
+
+    unsigned int RayTracer::getTilesCount() const
+    {
+        unsigned int tilesPerRow = (frameWidth_ + tileSize_ - 1) / tileSize_;
+        unsigned int tilesPerColumn = (frameHeight_ + tileSize_ - 1) / tileSize_;
+        return tilesPerRow * tilesPerColumn;
+    }
+
+    bool RayTracer::tracePreviewFrame(unsigned int pixelStep)
+    {
+        prepareFrame();
+
+        renderPass_ = kPreviewPass;
+        previewPixelStep_ = pixelStep > 0 ? pixelStep : 1;
+        return parallelRaytraceRunner_.runDynamic(getTilesCount(), cancellationToken_);
+    }
+
+    void RayTracer::reprojectPreviousFrame()
+    {
+        size_t pixelsCount = size_t(frameWidth_) * frameHeight_;
+        reprojectedSphereIdxs_.assign(pixelsCount, kNoSphere);
+        reprojectedDepths_.assign(pixelsCount, std::numeric_limits<double>::max());
+
+        // Every hit of the previous frame is put on the pixel it's seen through now. When
+        // a few hits end up on the same pixel the closest one to the camera wins.
+        glm::dmat4 sceneToCameraMatrix = glm::inverse(cameraToSceneMatrix_);
+        for (size_t pixelIdx = 0; pixelIdx < pixelsCount; pixelIdx++) {
+            if (geometryBuffer_.sphereIdxs[pixelIdx] == kNoSphere)
+                continue;
 
-            outer_.frameBuffer_[(kSceneHeight - 1 - y) * kSceneWidth + x] = 256 * intensity;
+            glm::dvec3 cameraHitPoint = glm::dvec3(sceneToCameraMatrix * glm::dvec4(geometryBuffer_.points[pixelIdx], 1));
+            if (cameraHitPoint.z <= 0)
+                continue;
 
-            // Go to the next pixel
-            x++;
-            if (x >= kSceneWidth) {
-                y++; x = 0;
+            // The inverse of primaryRayDirection
+            double x = cameraHitPoint.x / cameraHitPoint.z * zoomLevel_ + frameWidth_ / 2;
+            double y = cameraHitPoint.y / cameraHitPoint.z * zoomLevel_ + frameHeight_ / 2;
+            x = floor(x + 0.5);
+            y = floor(y + 0.5);
+            if (x < 0 || y < 0 || x >= frameWidth_ || y >= frameHeight_)
+                continue;
+
+            size_t reprojectedIdx = size_t(y) * frameWidth_ + size_t(x);
+            if (cameraHitPoint.z < reprojectedDepths_[reprojectedIdx]) {
+                reprojectedDepths_[reprojectedIdx] = cameraHitPoint.z;
+                reprojectedSphereIdxs_[reprojectedIdx] = geometryBuffer_.sphereIdxs[pixelIdx];
+            }
+        }
+
+        // Rounding leaves pixels that got no hit in between the ones that did. If both sides of
+        // such a hole got the same sphere the hole takes it too.
+        const unsigned int width = frameWidth_;
+        for (unsigned int y = 1; y + 1 < frameHeight_; y++) {
+            for (unsigned int x = 1; x + 1 < width; x++) {
+                size_t pixelIdx = size_t(y) * width + x;
+                if (reprojectedSphereIdxs_[pixelIdx] != kNoSphere)
+                    continue;
+
+                SphereIndex left = reprojectedSphereIdxs_[pixelIdx - 1];
+                SphereIndex up = reprojectedSphereIdxs_[pixelIdx - width];
+                if (left == reprojectedSphereIdxs_[pixelIdx + 1])
+                    reprojectedSphereIdxs_[pixelIdx] = left;
+                else if (up == reprojectedSphereIdxs_[pixelIdx + width])
+                    reprojectedSphereIdxs_[pixelIdx] = up;
             }
         }
     }
 
-    void RayTracer::traceFrame()
+    bool RayTracer::isGeometryBufferCurrent() const
     {
-        parallelRaytraceRunner_.run(kSceneWidth * kSceneHeight);
+        return geometryBufferValid_ && geometryBufferWidth_ == frameWidth_ && geometryBufferHeight_ == frameHeight_ &&
+               geometryBufferSceneVersion_ == sceneData_.getVersion();
+    }
+
+    bool RayTracer::traceFrame()
+    {
+        prepareFrame();
+
+        // The tiles are handed out dynamically because their cost varies a lot - 
+        // the ones in the middle of the sphereflake are much slower than the background
+        unsigned int tilesCount = getTilesCount();
+
+        // The primary rays are traced in a pass of their own for the adaptive anti-aliasing 
+        // (to find the edges) and to keep what they hit
+        bool temporalReprojection = temporalReprojectionEnabled_ && antiAliasingMode_ != kFullAntiAliasing;
+        bool geometryBuffer = geometryBufferEnabled_ && antiAliasingMode_ != kFullAntiAliasing;
+        if (antiAliasingMode_ != kAdaptiveAntiAliasing && !temporalReprojection && !geometryBuffer) {
+            geometryBufferValid_ = false;
+            renderPass_ = kFinalPass;
+            return parallelRaytraceRunner_.runDynamic(tilesCount, cancellationToken_);
+        }
+
+        // The hits of the previous frame can be reused only if they are in the same scene.
+        // The heatmap has to show what tracing the pixels costs, so everything is traced for it.
+        reprojectionAvailable_ = temporalReprojection && isGeometryBufferCurrent() && !costHeatmapEnabled_;
+        if (reprojectionAvailable_)
+            reprojectPreviousFrame();
+
+        size_t pixelsCount = size_t(frameWidth_) * frameHeight_;
+        primaryIntensities_.resize(pixelsCount);
+        geometryBuffer_.sphereIdxs.resize(pixelsCount);
+        geometryBuffer_.points.resize(pixelsCount);
+        if (geometryBuffer) {
+            geometryBuffer_.normals.resize(pixelsCount);
+            geometryBuffer_.depths.resize(pixelsCount);
+        }
+
+        renderPass_ = kPrimaryRaysPass;
+        geometryBufferValid_ = false;
+        if (!parallelRaytraceRunner_.runDynamic(tilesCount, cancellationToken_))
+            return false;
+
+        // Keep the hits for the next frame
+        geometryBufferValid_ = true;
+        geometryBufferComplete_ = geometryBuffer;
+        geometryBufferWidth_ = frameWidth_;
+        geometryBufferHeight_ = frameHeight_;
+        geometryBufferSceneVersion_ = sceneData_.getVersion();
+        geometryBufferZoomLevel_ = zoomLevel_;
+        geometryBufferCameraToSceneMatrix_ = cameraToSceneMatrix_;
+
+        // Without anti-aliasing the primary rays are all there is
+        if (antiAliasingMode_ == kNoAntiAliasing)
+            return true;
+
+        // The edges can be found only when all the primary rays are traced, so it takes two passes
+        renderPass_ = kEdgesPass;
+        return parallelRaytraceRunner_.runDynamic(tilesCount, cancellationToken_);
+    }
+
+    bool RayTracer::reshadeFrame()
+    {
+        // The geometry has to be the same as in the frame the buffer was filled for
+        if (!isGeometryBufferCurrent() || !geometryBufferComplete_ || antiAliasingMode_ == kFullAntiAliasing ||
+            geometryBufferZoomLevel_ != zoomLevel_ || geometryBufferCameraToSceneMatrix_ != cameraToSceneMatrix_ ||
+            costHeatmapEnabled_)
+            return false;
+
+        prepareFrame();
+        unsigned int tilesCount = getTilesCount();
+
+        renderPass_ = kReshadePass;
+        if (!parallelRaytraceRunner_.runDynamic(tilesCount, cancellationToken_))
+            return false;
+
+        if (antiAliasingMode_ == kNoAntiAliasing)
+            return true;
+
+        // The edges depend on the light too, they are found and supersampled again
+        renderPass_ = kEdgesPass;
+        return parallelRaytraceRunner_.runDynamic(tilesCount, cancellationToken_);
     }
-}
\ No newline at end of file
+}
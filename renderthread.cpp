@@ -0,0 +1,161 @@
+#include <QDebug>
+#include <QMutexLocker>
+
+#include "renderthread.h"
+
+RenderThread::RenderThread(MyRaytracer::RayTracer &rayTracer)
+    : rayTracer_(rayTracer),
+      frameRequested_(false),
+      paused_(false),
+      rendering_(false),
+      quit_(false),
+      backImageIdx_(0)
+{
+    for(int i = 0; i < 256; i++)
+        grayScaleTable_.push_back(qRgb(i,i,i));
+    for (int i = 0; i < 256; i++) {
+        glm::dvec3 color = MyRaytracer::heatmapColor(i);
+        heatmapTable_.push_back(qRgb(255 * color.r, 255 * color.g, 255 * color.b));
+    }
+
+    rayTracer_.setCancellationToken(&cancellationToken_);
+    // Keeps what the frames hit, so that moving the light doesn't need tracing
+    rayTracer_.setGeometryBufferEnabled(true);
+}
+
+RenderThread::~RenderThread()
+{
+    {
+        QMutexLocker locker(&mutex_);
+        quit_ = true;
+        cancellationToken_.cancel();
+        condition_.wakeAll();
+    }
+
+    wait();
+    rayTracer_.setCancellationToken(nullptr);
+}
+
+void RenderThread::requestFrame(const FrameSettings &settings)
+{
+    QMutexLocker locker(&mutex_);
+    requestedSettings_ = settings;
+    frameRequested_ = true;
+    // The frame in progress is stale already
+    cancellationToken_.cancel();
+    condition_.wakeAll();
+}
+
+void RenderThread::pause()
+{
+    QMutexLocker locker(&mutex_);
+    paused_ = true;
+    cancellationToken_.cancel();
+    while (rendering_)
+        condition_.wait(&mutex_);
+}
+
+void RenderThread::resume()
+{
+    QMutexLocker locker(&mutex_);
+    paused_ = false;
+    condition_.wakeAll();
+}
+
+bool RenderThread::waitForRequest(unsigned long milliseconds)
+{
+    QMutexLocker locker(&mutex_);
+    if (!frameRequested_ && !paused_ && !quit_)
+        condition_.wait(&mutex_, milliseconds);
+
+    return frameRequested_ || paused_ || quit_;
+}
+
+void RenderThread::setUpFrame(const FrameSettings &settings)
+{
+    QImage &image = images_[backImageIdx_];
+    if (image.width() != int(settings.width) || image.height() != int(settings.height))
+        image = QImage(settings.width, settings.height, QImage::Format_Indexed8);
+    // The heatmap has the costs of the pixels in the image instead of their shades
+    image.setColorTable(settings.costHeatmap ? heatmapTable_ : grayScaleTable_);
+
+    // bits() makes a copy if the GUI still holds the image from the last time it was shown
+    rayTracer_.setFrameBuffer(image.bits(), image.bytesPerLine());
+    rayTracer_.setFrameSize(settings.width, settings.height);
+    rayTracer_.setZoomLevel(settings.zoomLevel);
+    rayTracer_.setAntiAliasingMode(settings.antiAliasingMode);
+    rayTracer_.setTemporalReprojection(settings.temporalReprojection);
+    rayTracer_.setCostHeatmapEnabled(settings.costHeatmap);
+    rayTracer_.setViewMatrix(settings.viewMatrix);
+}
+
+void RenderThread::showFrame()
+{
+    emit frameReady(images_[backImageIdx_]);
+    backImageIdx_ = 1 - backImageIdx_;
+}
+
+bool RenderThread::renderPass(const FrameSettings &settings, unsigned int pixelStep)
+{
+    setUpFrame(settings);
+
+    bool finished = pixelStep > 1 ? rayTracer_.tracePreviewFrame(pixelStep) : rayTracer_.traceFrame();
+    // A cancelled frame is half done, it's never shown
+    if (!finished)
+        return false;
+
+    if (settings.costHeatmap) {
+        MyRaytracer::TraversalStats stats = rayTracer_.getFrameTraversalStats();
+        double rays = stats.rays > 0 ? double(stats.rays) : 1.0;
+        qDebug() << "Traversal per ray: bound tests" << stats.boundTests / rays << "sphere tests" << stats.sphereTests / rays
+                 << "skipped subtrees" << stats.skippedSubtrees / rays << "hits" << stats.hits / rays;
+    }
+
+    showFrame();
+    return true;
+}
+
+bool RenderThread::reshadeFrame(const FrameSettings &settings)
+{
+    setUpFrame(settings);
+
+    if (!rayTracer_.reshadeFrame())
+        return false;
+
+    showFrame();
+    return true;
+}
+
+void RenderThread::run()
+{
+    QMutexLocker locker(&mutex_);
+
+    while (true) {
+        while (!quit_ && (paused_ || !frameRequested_))
+            condition_.wait(&mutex_);
+        if (quit_)
+            break;
+
+        FrameSettings settings = requestedSettings_;
+        frameRequested_ = false;
+        cancellationToken_.reset();
+        rendering_ = true;
+        locker.unlock();
+
+        // When just the light changed the last frame is shaded again instead of traced.
+        // Otherwise the coarse passes are shown right away. The camera usually keeps moving 
+        // for a while, so the refining starts only if no new frame is requested soon.
+        if (!reshadeFrame(settings)) {
+            unsigned int pixelStep = settings.progressiveRendering ? kCoarsestPreviewPixelStep : 1;
+            while (renderPass(settings, pixelStep) && pixelStep > 1) {
+                if (pixelStep == kCoarsestPreviewPixelStep && waitForRequest(kRefinementDelayMs))
+                    break;
+                pixelStep /= 2;
+            }
+        }
+
+        locker.relock();
+        rendering_ = false;
+        condition_.wakeAll();
+    }
+}
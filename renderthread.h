@@ -0,0 +1,99 @@
+#ifndef RENDERTHREAD_H
+#define RENDERTHREAD_H
+
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <glm/mat4x4.hpp>
+
+#include "cancellationtoken.h"
+#include "raytracer.h"
+#include "settings.h"
+
+// Everything that describes a frame to render
+struct FrameSettings
+{
+    FrameSettings() : 
+        viewMatrix(1.0), 
+        zoomLevel(100),
+        width(kDefaultSceneWidth), 
+        height(kDefaultSceneHeight),
+        antiAliasingMode(MyRaytracer::kAdaptiveAntiAliasing),
+        progressiveRendering(true),
+        temporalReprojection(false),
+        costHeatmap(false) {}
+
+    glm::dmat4 viewMatrix;
+    int zoomLevel;
+    unsigned int width;
+    unsigned int height;
+    MyRaytracer::AntiAliasingMode antiAliasingMode;
+    // Show coarse previews first and refine them while no new frame is requested
+    bool progressiveRendering;
+    // Reuse the hits of the previous frame
+    bool temporalReprojection;
+    // Show how expensive the pixels are instead of the scene
+    bool costHeatmap;
+};
+
+// Renders the frames on a thread of its own, so that the GUI stays responsive.
+// Only the latest frame requested matters - a new request cancels the frame in progress.
+// The frames are rendered in one of two images while the other one is shown.
+class RenderThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    RenderThread(MyRaytracer::RayTracer &rayTracer);
+    ~RenderThread();
+
+    // Renders a frame as soon as possible, the previous request is dropped
+    void requestFrame(const FrameSettings &settings);
+
+    // Cancels the frame in progress and keeps the thread away from the scene until resume is called.
+    // The scene can be changed safely in the meantime.
+    void pause();
+    void resume();
+
+signals:
+    // A frame or a progressive pass of a frame is done
+    void frameReady(const QImage &frame);
+
+protected:
+    void run();
+
+private:
+    // Renders a pass in the back image and shows it. Returns false if it was cancelled.
+    bool renderPass(const FrameSettings &settings, unsigned int pixelStep);
+    // Shades the last frame again in the back image and shows it. Returns false if it was
+    // cancelled or it can't be done because more than the light changed since.
+    bool reshadeFrame(const FrameSettings &settings);
+    // Points the ray tracer to the back image and sets the frame up
+    void setUpFrame(const FrameSettings &settings);
+    // Shows the back image, the next frame goes in the other one
+    void showFrame();
+    // Waits for a new request for up to milliseconds. Returns false if none came.
+    bool waitForRequest(unsigned long milliseconds);
+
+    MyRaytracer::RayTracer &rayTracer_;
+    MyRaytracer::CancellationToken cancellationToken_;
+
+    // Guards everything below but the images
+    QMutex mutex_;
+    QWaitCondition condition_;
+    FrameSettings requestedSettings_;
+    bool frameRequested_;
+    bool paused_;
+    bool rendering_;
+    bool quit_;
+
+    QImage images_[2];
+    int backImageIdx_;
+    QVector<QRgb> grayScaleTable_;
+    QVector<QRgb> heatmapTable_;
+};
+
+#endif // RENDERTHREAD_H
@@ -1,18 +1,223 @@
 #include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
 
 #include <glm/vec4.hpp>
 #include <glm/gtx/norm.hpp>
 
 #include "asyncrunner.h"
 #include "scenedata.h"
+#include "widebvh.h"
 
 namespace MyRaytracer 
 {
-    SceneData::SceneData() :
-        tree_(nullptr),
+    namespace
+    {
+        // Every array of the tree starts on its own cache line
+        const size_t kNodeArrayAlignment = 64;
+
+        // Subtrees with up to that many nodes are not walked - all their spheres are tested
+        // at once with the SIMD kernel (these are the nodes just above the leaves and the leaves)
+        const unsigned int kMaxBatchedSubtreeSize = 16;
+
+        // How deep the packet traversal can go in the tree
+        const unsigned int kMaxTraversalDepth = 32;
+        // The deepest tree whose spheres can be counted in 64 bits
+        const unsigned int kMaxLevels = 20;
+        // How many subtrees the ordered traversal can have waiting (at most 8 siblings per level and the root)
+        const unsigned int kMaxPendingSubtrees = kMaxTraversalDepth * 8 + 1;
+
+#ifdef SPHEREFLAKE_CLUSTERED_TREE
+        // The tree is stored in blocks of 3 levels (91 nodes, under a kilobyte in every array), so that
+        // a ray going down the tree finds the next few levels on the cache lines and the page it already has.
+        // In the depth-first order the siblings near the top are far apart and every level is on another page.
+        const unsigned int kTreeBlockLevels = 3;
+#else
+        // The whole tree is a single block
+        const unsigned int kTreeBlockLevels = kMaxLevels;
+#endif
+        // The blocks are counted from the bottom of the tree, so the subtrees tested at once are always whole in a block
+        static_assert(kTreeBlockLevels >= 2, "The subtrees of the last two levels have to be in one piece");
+
+        // Smaller trees are filled on a single thread, handing out the work would take longer
+        const SphereIndex kMinParallelTreeSize = 9 * 9 * 9 * 9;
+        // The tree is split in at least that many subtrees for every thread, so that they are evenly loaded
+        const unsigned int kSubtreesPerThread = 8;
+
+        // The traversals carry just the distance and the index of the closest hit so far.
+        // The point and the normal are made once the closest hit is known.
+        void setIntersection(const Ray &ray, double t, const Sphere &sphere, SphereIndex sphereIdx, 
+                             Intersection &result)
+        {
+            result.point = t * ray.direction + ray.origin;
+            result.surfaceNormal = (result.point - sphere.center) / sphere.radius;
+            result.sphereIdx = sphereIdx;
+        }
+
+        size_t alignedSize(size_t size)
+        {
+            return (size + kNodeArrayAlignment - 1) / kNodeArrayAlignment * kNodeArrayAlignment;
+        }
+
+        // Gets the size of one of the node arrays with the padding to the next one.
+        // Returns false if all four of them don't fit in size_t.
+        bool getNodeArraySize(SphereIndex nodesCount, size_t &arraySize)
+        {
+            if (nodesCount > (std::numeric_limits<size_t>::max() - 8 * kNodeArrayAlignment) / (4 * sizeof(StorageReal)))
+                return false;
+
+            arraySize = alignedSize(nodesCount * sizeof(StorageReal));
+            return true;
+        }
+
+        // The tree cache files start with this header. The four node arrays follow it
+        // one after the other, padded to kNodeArrayAlignment like allocateNodes does.
+        struct TreeCacheHeader
+        {
+            char magic[8];
+            // Goes up every time the format or the way the tree is built changes
+            unsigned int version;
+            // Tells the byte order of the machine that wrote the file
+            unsigned int byteOrderMark;
+            unsigned int levels;
+            unsigned int realSize;
+            unsigned long long spheresCount;
+            unsigned long long arraySize;
+            // The order of the nodes
+            unsigned int blockLevels;
+            // Keeps the arrays aligned in the mapped memory
+            unsigned char padding[kNodeArrayAlignment - 44];
+        };
+
+        static_assert(sizeof(TreeCacheHeader) == kNodeArrayAlignment, "The header has to keep the arrays aligned");
+
+        const char kTreeCacheMagic[8] = { 'S', 'P', 'H', 'F', 'L', 'A', 'K', 'E' };
+        const unsigned int kTreeCacheVersion = 2;
+        const unsigned int kTreeCacheByteOrderMark = 0x01020304;
+        // The cache file is written in pieces that big, so that the writing can be cancelled between them
+        const size_t kTreeCacheWriteChunkSize = 64 * 1024 * 1024;
+
+        // Every sphere has 6 children across its equator and 3 at its top. Their directions in the basis
+        // of the parent are the same for every sphere, so this is all the procedural instancing has to store.
+        struct ChildDirections
+        {
+            ChildDirections() {
+                // Equator spheres
+                for (int i = 0; i < 6; i++) {
+                    double angle = i * (360 / 6);
+
+                    double phi = glm::radians(90.0);     
+                    double theta = glm::radians(angle); 
+                    directions[i] = glm::dvec3(sin(phi) * cos(theta), cos(phi), sin(phi) * sin(theta));
+                }
+                // North spheres
+                for (int i = 6; i < 9; i++) {
+                    double angle = (i - 6) * (360 / 3) + 30;
+                    double phi = glm::radians(30.0);     
+                    double theta = glm::radians(angle); 
+                    directions[i] = glm::dvec3(sin(phi) * cos(theta), cos(phi), sin(phi) * sin(theta));
+                }
+            }
+
+            glm::dvec3 directions[9];
+        };
+        const ChildDirections kChildDirections;
+
+        // The basis of a sphere, its y axis is the up vector of the sphere
+        struct SphereBasis
+        {
+            SphereBasis() {}
+            SphereBasis(const glm::dvec3 &up) : x(1, 0, 0), y(0, 1, 0), z(0, 0, 1) {
+                if (up.x != 0 && up.z != 0)
+                {
+                    y = glm::normalize(up);
+                    z = glm::normalize(glm::cross(y, glm::dvec3(0, 1, 0)));
+                    x = glm::normalize(glm::cross(y, z));
+                }
+            }
+
+            // Returns the direction from the center of the sphere to the center of a child.
+            // It is also the up vector of the child.
+            glm::dvec3 childDirection(int childIdx) const {
+                const glm::dvec3 &direction = kChildDirections.directions[childIdx];
+                return glm::normalize(direction.x * x + direction.y * y + direction.z * z);
+            }
+
+            glm::dvec3 x, y, z;
+        };
+
+        // Moves from a node to its first child. below is where the part of the subtree of the node below its block
+        // starts, it's moved to that of the child. The next children are the sibling strides of the child's level away.
+        void moveToFirstChild(const TreeLevel &childLevel, SphereIndex &idx, SphereIndex &below)
+        {
+            if (childLevel.blockRoot) {
+                idx = below;
+                below += childLevel.blockSubtreeSize;
+            } else {
+                idx++;
+            }
+        }
+
+        // Moves a scan of the tree past the subtree of the node it's at - to the next sibling of the node or of the
+        // closest of its parents that has one. The parents are the nodes the scan went in, with the number of their
+        // children still to scan. Returns false once the whole tree is scanned.
+        template <typename ParentSubtree>
+        bool skipSubtree(const std::vector<TreeLevel> &levels, ParentSubtree *parents, unsigned int &parentsCount,
+                         SphereIndex &idx, SphereIndex &below)
+        {
+            while (parentsCount > 0) {
+                ParentSubtree &parent = parents[parentsCount - 1];
+                if (--parent.childrenLeft > 0) {
+                    idx += levels[parentsCount].siblingStride;
+                    below += levels[parentsCount].belowSiblingStride;
+                    return true;
+                }
+
+                parentsCount--;
+                idx = parent.idx;
+                below = parent.below;
+            }
+
+            return false;
+        }
+
+        // Sorts the children of a node from the farthest to the closest, so that after pushing
+        // them in that order the closest one is on top of the traversal stack
+        template <typename Child>
+        void sortFarthestFirst(Child *children, unsigned int count)
+        {
+            for (unsigned int i = 1; i < count; i++) {
+                Child child = children[i];
+                unsigned int j = i;
+                for (; j > 0 && children[j - 1].entry_t < child.entry_t; j--)
+                    children[j] = children[j - 1];
+                children[j] = child;
+            }
+        }
+    }
+
+    SceneData::SceneData(ThreadPool &threadPool) :
+        threadPool_(threadPool),
+        nodeMemoryFlags_(kDefaultNodeMemory),
+        accelerationStructure_(kSkipListTree),
         levels_(0),
-        spheresCount_(0)
+        spheresCount_(0),
+        version_(0)
+    {
+        setSpheresKernelIsa(detectSpheresKernelIsa());
+    }
+
+    void SceneData::setSpheresKernelIsa(SpheresKernelIsa isa)
     {
+        spheresKernelIsa_ = isa;
+        spheresBatchIntersect_ = getSpheresBatchIntersect(isa);
+        qDebug() << "Using the" << getSpheresKernelIsaName(isa) << "spheres kernel";
     }
 
     SceneData::~SceneData()
@@ -22,119 +227,362 @@ namespace MyRaytracer
 
     void SceneData::clear()
     {
-        if (tree_) {
-            delete [] tree_; tree_ = nullptr;
-            levels_ = 0;
-            spheresCount_ = 0;
-        }
+        // The writer reads the tree, it has to be done before the tree goes away
+        stopTreeCacheWrite();
+        treeMemory_.release();
+        // Closing the file unmaps the tree
+        treeCacheFile_.reset();
+        tree_ = BVHNodes();
+        wideBVH4_.reset();
+        wideBVH8_.reset();
+        levels_ = 0;
+        spheresCount_ = 0;
+        treeLevels_.clear();
+        version_++;
     }
 
-    void SceneData::create(unsigned int level, unsigned int idx, unsigned int nodesCount, 
-        const glm::dvec3 &center, const glm::dvec3 &up, double radius)
+    void SceneData::create(unsigned int level, SphereIndex idx, SphereIndex below, 
+        const glm::dvec3 &center, const glm::dvec3 &up, double radius,
+        std::vector<SubtreeRoot> *deferredRoots, unsigned int deferredLevel)
     {
         // end of recursion
         if (level > levels_ - 1)
             return;
 
-        // This is the new basis, based on the up vector
-        glm::dvec3 new_x(1, 0, 0);
-        glm::dvec3 new_y(0, 1, 0);
-        glm::dvec3 new_z(0, 0, 1);
-        if (up.x != 0 && up.z != 0)
-        {
-            new_y = glm::normalize(up);
-            new_z = glm::normalize(glm::cross(new_y, glm::dvec3(0, 1, 0)));
-            new_x = glm::normalize(glm::cross(new_y, new_z));
+        if (deferredRoots && level == deferredLevel) {
+            SubtreeRoot root;
+            root.level = level;
+            root.idx = idx;
+            root.below = below;
+            root.center = center;
+            root.up = up;
+            root.radius = radius;
+            deferredRoots->push_back(root);
+            return;
         }
 
+        // This is the new basis, based on the up vector
+        SphereBasis basis(up);
+
         // We can bound all the child spheres and its children in a sphere
         // with a sphere with a two times bigger radius
-        tree_[idx].boundSphere = Sphere(center, 2*radius);
-        tree_[idx].sphereObj = Sphere(center, radius);
-        tree_[idx].nextSiblingInc = nodesCount;
+        tree_.centerX[idx] = center.x;
+        tree_.centerY[idx] = center.y;
+        tree_.centerZ[idx] = center.z;
+        tree_.radius[idx] = radius;
 
-        int subtreeNodesCount = (nodesCount - 1)  / 9;
+        const TreeLevel &childLevel = treeLevels_[level + 1];
+        SphereIndex placeAt = idx;
+        SphereIndex childBelow = below;
+        moveToFirstChild(childLevel, placeAt, childBelow);
 
         double newRadius = radius / 3;
 
-        // Put equator spheres
-        for (int i = 0; i < 6; i++) {
-            int placeAt = idx + 1 + i * subtreeNodesCount;
-
-            double angle = i * (360 / 6);
+        // Put equator spheres and then north spheres
+        for (int i = 0; i < 9; i++) {
+            glm::dvec3 tangentDirection = basis.childDirection(i);
 
-            double phi = glm::radians(90.0);     
-            double theta = glm::radians(angle); 
-            double x = sin(phi) * cos(theta);
-            double y = cos(phi);
-            double z = sin(phi) * sin(theta);
-            glm::dvec3 tangentDirection = glm::normalize(x * new_x + y * new_y + z * new_z);
+            create(level + 1, placeAt, childBelow, center + (tangentDirection * (radius + newRadius)) , tangentDirection, newRadius,
+                   deferredRoots, deferredLevel);
 
-            create(level + 1, placeAt, subtreeNodesCount, center + (tangentDirection * (radius + newRadius)) , tangentDirection, newRadius);
+            placeAt += childLevel.siblingStride;
+            childBelow += childLevel.belowSiblingStride;
         }
-        // Put north spheres
-        for (int i = 6; i < 9; i++) {
-            int placeAt = idx + 1 + i * subtreeNodesCount;
-
-            double angle = (i - 6) * (360 / 3) + 30;
-            double phi = glm::radians(30.0);     
-            double theta = glm::radians(angle); 
-            double x = sin(phi) * cos(theta);
-            double y = cos(phi);
-            double z = sin(phi) * sin(theta);
-            glm::dvec3 tangentDirection = glm::normalize(x * new_x + y * new_y + z * new_z);
+    }
 
-            create(level + 1, placeAt, subtreeNodesCount, center + (tangentDirection * (radius + newRadius)) , tangentDirection, newRadius);
+    void SceneData::CreateSubtreesTask::operator()(unsigned int startIdx, unsigned int endIdx)
+    {
+        // Every subtree has its own nodes in the tree, so they don't get in each other's way
+        for (unsigned int rootIdx = startIdx; rootIdx <= endIdx; rootIdx++) {
+            const SubtreeRoot &root = roots_[rootIdx];
+            outer_.create(root.level, root.idx, root.below, root.center, root.up, root.radius);
         }
     }
 
     bool SceneData::buildStructure(unsigned int levels)
     {
-        if (spheresCount_ > 0)
-            clear();
+        clear();
+
+        // The traversals keep a stack as deep as the tree and the spheres have to be counted in 64 bits
+        if (levels > kMaxTraversalDepth || levels > kMaxLevels)
+            return false;
 
+        levels_ = levels;
         spheresCount_ = getSpheresCount(levels);
+        for (unsigned int depth = 0; depth <= levels; depth++) {
+            // The blocks end at every kTreeBlockLevels levels from the bottom, the one at the top can be smaller
+            unsigned int blockBottom = (depth < levels) ? levels - (levels - depth - 1) / kTreeBlockLevels * kTreeBlockLevels : levels;
+
+            TreeLevel level;
+            level.subtreeSize = getSpheresCount(levels - depth);
+            level.blockSubtreeSize = getSpheresCount(blockBottom - depth);
+            level.blockRoot = depth == 0 || (depth < levels && (levels - depth) % kTreeBlockLevels == 0);
+            // The roots of the blocks follow each other with their whole subtrees. The other
+            // nodes are followed by their siblings in the block and below it separately.
+            level.siblingStride = level.blockRoot ? level.subtreeSize : level.blockSubtreeSize;
+            level.belowSiblingStride = level.blockRoot ? level.subtreeSize : level.subtreeSize - level.blockSubtreeSize;
+            treeLevels_.push_back(level);
+        }
         qDebug() << "Building a structure with " << spheresCount_ << " spheres ... ";
 
-        tree_ = new (std::nothrow) BVHNode[spheresCount_];
-        if (tree_ == nullptr) {
+        // The procedural instances don't need the tree at all
+        if (accelerationStructure_ != kProceduralInstances && !materializeTree()) {
+            clear();
+            return false;
+        }
+
+        if (!buildAccelerationStructure(accelerationStructure_)) {
+            // Fall back to the tree, it's always there
+            accelerationStructure_ = kSkipListTree;
+        }
+
+        return true;
+    }
+
+    bool SceneData::materializeTree()
+    {
+        // A tree built before is used straight from its cache file
+        if (loadTreeCache())
+            return true;
+
+        if (!allocateNodes(spheresCount_)) {
             qDebug() << "Failed to allocate memory for " << spheresCount_ << " spheres ... ";
-            spheresCount_ = 0;
             return false;
         }
 
-        levels_ = levels;
+        if (!createTree())
+            return false;
+
+        if (!treeCacheDirectory_.isEmpty())
+            startTreeCacheWrite();
+
+        return true;
+    }
+
+    bool SceneData::createTree()
+    {
+        const glm::dvec3 rootCenter(0, 0, 0);
+        const glm::dvec3 rootUp(0, 1, 0);
+        const SphereIndex rootBelow = treeLevels_[0].blockSubtreeSize;
+        if (spheresCount_ < kMinParallelTreeSize || threadPool_.getThreadsCount() < 2) {
+            create(0, 0, rootBelow, rootCenter, rootUp, 1.0);
+            return true;
+        }
+
+        // The top of the tree is created right away. The subtrees below the level that has enough
+        // of them for all the threads are created in parallel.
+        unsigned int parallelLevel = 1;
+        SphereIndex subtreesCount = 9;
+        while (subtreesCount < threadPool_.getThreadsCount() * kSubtreesPerThread && parallelLevel + 1 < levels_) {
+            parallelLevel++;
+            subtreesCount *= 9;
+        }
+
+        std::vector<SubtreeRoot> roots;
+        try {
+            roots.reserve((size_t)subtreesCount);
+        } catch (const std::bad_alloc &) {
+            qDebug() << "Failed to allocate memory for the subtrees to build";
+            return false;
+        }
+        create(0, 0, rootBelow, rootCenter, rootUp, 1.0, &roots, parallelLevel);
+
+        AsyncRunner<CreateSubtreesTask> createSubtreesRunner(CreateSubtreesTask(*this, roots), threadPool_);
+        createSubtreesRunner.run((unsigned int)roots.size());
+
+        return true;
+    }
+
+    QString SceneData::getTreeCacheFileName() const
+    {
+        // The trees with single and double precision spheres and the ones stored in blocks are different files
+        return QDir(treeCacheDirectory_).filePath(QString("sphereflake-%1-%2%3.tree")
+            .arg(levels_).arg(sizeof(StorageReal) == sizeof(float) ? "float" : "double")
+            .arg(kTreeBlockLevels < kMaxLevels ? "-clustered" : ""));
+    }
+
+    bool SceneData::loadTreeCache()
+    {
+        size_t arraySize;
+        if (treeCacheDirectory_.isEmpty() || !getNodeArraySize(spheresCount_, arraySize))
+            return false;
+
+        std::unique_ptr<QFile> file(new (std::nothrow) QFile(getTreeCacheFileName()));
+        if (!file || !file->open(QIODevice::ReadOnly))
+            return false;
 
-        create(0, 0, spheresCount_, glm::dvec3(0, 0, 0), glm::dvec3(0, 1, 0), 1.0);
+        // A file of another size is out of date for sure, no need to map it to find out
+        if (file->size() != qint64(sizeof(TreeCacheHeader) + 4 * arraySize))
+            return false;
+
+        // The mapping is page aligned, so the arrays are aligned the same way as the header pads them
+        uchar *fileMemory = file->map(0, file->size());
+        if (!fileMemory)
+            return false;
+
+        const TreeCacheHeader &header = *reinterpret_cast<const TreeCacheHeader *>(fileMemory);
+        if (memcmp(header.magic, kTreeCacheMagic, sizeof(kTreeCacheMagic)) != 0 ||
+            header.version != kTreeCacheVersion || header.byteOrderMark != kTreeCacheByteOrderMark ||
+            header.levels != levels_ || header.realSize != sizeof(StorageReal) ||
+            header.spheresCount != spheresCount_ || header.arraySize != arraySize || header.blockLevels != kTreeBlockLevels) {
+            qDebug() << "The tree in" << file->fileName() << "is out of date";
+            return false;
+        }
+
+        unsigned char *arrayStart = fileMemory + sizeof(TreeCacheHeader);
+        tree_.centerX = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += arraySize;
+        tree_.centerY = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += arraySize;
+        tree_.centerZ = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += arraySize;
+        tree_.radius = reinterpret_cast<StorageReal *>(arrayStart);
+        treeCacheFile_ = std::move(file);
 
+        qDebug() << "Mapped the tree from" << treeCacheFile_->fileName();
         return true;
     }
 
-    unsigned int SceneData::getSpheresCount(unsigned int level)
+    void SceneData::startTreeCacheWrite()
+    {
+        // The tree is never changed after it's built, so it can be read while the rays are traced.
+        // The big trees take seconds to write, the build doesn't wait for it.
+        stopTreeCacheWrite();
+        QString fileName = getTreeCacheFileName();
+        treeCacheWriter_ = std::thread([this, fileName] {
+            if (!saveTreeCache(fileName)) {
+                if (treeCacheWriteCancellation_.isCancelled())
+                    qDebug() << "Stopped writing the tree to" << fileName;
+                else
+                    qDebug() << "Failed to write the tree to" << fileName;
+            }
+        });
+    }
+
+    void SceneData::waitForTreeCache()
+    {
+        if (treeCacheWriter_.joinable())
+            treeCacheWriter_.join();
+    }
+
+    void SceneData::stopTreeCacheWrite()
+    {
+        if (!treeCacheWriter_.joinable())
+            return;
+
+        treeCacheWriteCancellation_.cancel();
+        treeCacheWriter_.join();
+        treeCacheWriteCancellation_.reset();
+    }
+
+    bool SceneData::saveTreeCache(const QString &fileName) const
+    {
+        size_t arraySize;
+        if (!getNodeArraySize(spheresCount_, arraySize) || !QDir().mkpath(QFileInfo(fileName).absolutePath()))
+            return false;
+
+        TreeCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kTreeCacheMagic, sizeof(kTreeCacheMagic));
+        header.version = kTreeCacheVersion;
+        header.byteOrderMark = kTreeCacheByteOrderMark;
+        header.levels = levels_;
+        header.realSize = sizeof(StorageReal);
+        header.spheresCount = spheresCount_;
+        header.arraySize = arraySize;
+        header.blockLevels = kTreeBlockLevels;
+
+        // The file replaces the old one only once it's complete. The processes that have the
+        // old one mapped keep it, nobody ever sees a file that is half written.
+        QSaveFile file(fileName);
+        if (!file.open(QIODevice::WriteOnly))
+            return false;
+
+        bool written = file.write(reinterpret_cast<const char *>(&header), sizeof(header)) == qint64(sizeof(header));
+
+        const StorageReal *arrays[4] = { tree_.centerX, tree_.centerY, tree_.centerZ, tree_.radius };
+        const size_t dataSize = spheresCount_ * sizeof(StorageReal);
+        const char padding[kNodeArrayAlignment] = {};
+        for (int arrayIdx = 0; arrayIdx < 4 && written; arrayIdx++) {
+            const char *data = reinterpret_cast<const char *>(arrays[arrayIdx]);
+            for (size_t offset = 0; offset < dataSize && written; offset += kTreeCacheWriteChunkSize) {
+                // Nothing of a cancelled file is kept
+                if (treeCacheWriteCancellation_.isCancelled()) {
+                    file.cancelWriting();
+                    return false;
+                }
+                qint64 chunkSize = qint64(std::min(kTreeCacheWriteChunkSize, dataSize - offset));
+                written = file.write(data + offset, chunkSize) == chunkSize;
+            }
+            written = written && file.write(padding, arraySize - dataSize) == qint64(arraySize - dataSize);
+        }
+
+        return written && file.commit();
+    }
+
+    bool SceneData::setAccelerationStructure(AccelerationStructure accelerationStructure)
     {
-        if (level == 0)
-            return 0;
-        if (level == 1)
-            return 1;
-        else 
-            return getSpheresCount(level - 1)*10 - 9*getSpheresCount(level - 2);
+        if (!buildAccelerationStructure(accelerationStructure))
+            return false;
+
+        accelerationStructure_ = accelerationStructure;
+        return true;
     }
 
-    void SceneData::TransformPointsParallelTask::operator()(unsigned int taskSphereStartIdx,
-                                                            unsigned int taskSphereEndIdx)
+    bool SceneData::buildAccelerationStructure(AccelerationStructure accelerationStructure)
     {
-        for (unsigned int sphereIdx = taskSphereStartIdx; sphereIdx <= taskSphereEndIdx; sphereIdx++) {
-            outer_.tree_[sphereIdx].boundSphere.center = 
-                glm::dvec3(transformMatrix_ * glm::dvec4(outer_.tree_[sphereIdx].boundSphere.center, 1));
+        // Nothing to build on yet, it will be done together with the tree
+        if (spheresCount_ == 0)
+            return true;
 
-            outer_.tree_[sphereIdx].sphereObj.center = outer_.tree_[sphereIdx].boundSphere.center;
+        // Everything except the procedural instances needs the tree
+        if (accelerationStructure != kProceduralInstances && !tree_.radius && !materializeTree())
+            return false;
+
+        if (accelerationStructure == kWideBVH4 && !wideBVH4_) {
+            wideBVH4_.reset(new (std::nothrow) WideBVH<4>);
+            if (!wideBVH4_ || !wideBVH4_->build(tree_, spheresCount_)) {
+                wideBVH4_.reset();
+                return false;
+            }
+        }
+        if (accelerationStructure == kWideBVH8 && !wideBVH8_) {
+            wideBVH8_.reset(new (std::nothrow) WideBVH<8>);
+            if (!wideBVH8_ || !wideBVH8_->build(tree_, spheresCount_)) {
+                wideBVH8_.reset();
+                return false;
+            }
         }
+
+        return true;
     }
 
-    void SceneData::transformPoints(const glm::dmat4 &transformMatrix)
+    bool SceneData::allocateNodes(SphereIndex nodesCount)
     {
-        AsyncRunner<TransformPointsParallelTask> runner_(TransformPointsParallelTask(*this, transformMatrix));
-        runner_.run(spheresCount_);
+        // The size of the block has to fit in size_t
+        size_t realsArraySize;
+        if (!getNodeArraySize(nodesCount, realsArraySize))
+            return false;
+
+        if (!treeMemory_.allocate(4 * realsArraySize + kNodeArrayAlignment, nodeMemoryFlags_))
+            return false;
+
+        unsigned char *arrayStart = treeMemory_.data() + 
+            (kNodeArrayAlignment - reinterpret_cast<size_t>(treeMemory_.data()) % kNodeArrayAlignment) % kNodeArrayAlignment;
+
+        tree_.centerX = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += realsArraySize;
+        tree_.centerY = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += realsArraySize;
+        tree_.centerZ = reinterpret_cast<StorageReal *>(arrayStart); arrayStart += realsArraySize;
+        tree_.radius = reinterpret_cast<StorageReal *>(arrayStart);
+
+        return true;
+    }
+
+    SphereIndex SceneData::getSpheresCount(unsigned int level)
+    {
+        // Every sphere has 9 children, so it's 1 + 9 + 9^2 + ... + 9^(level - 1) = (9^level - 1) / 8
+        SphereIndex power = 1;
+        for (unsigned int i = 0; i < level; i++)
+            power *= 9;
+
+        return (power - 1) / 8;
     }
 
     bool Sphere::intersects(const Ray &ray, double &t) const
@@ -158,43 +606,570 @@ namespace MyRaytracer
         return true;
     }
 
+    bool Sphere::intersectsEntry(const Ray &ray, double &t) const
+    {
+        glm::dvec3 dst = center - ray.origin;
+        double b = glm::dot(dst, ray.direction);
+        double c = b*b - glm::dot(dst, dst) + radius * radius;
+
+        if (c < 0) 
+            return false;
+
+        double d = sqrt(c); 
+
+        if (b + d < 0)
+            return false;
+
+        double f = b - d;
+        t = (f > 0) ? f : 0;
+
+        return true;
+    }
+
     bool SceneData::getIntersection(const Ray &ray, Intersection &result) const 
     {
+        NoTraversalStats stats;
+        return intersect(ray, result, stats);
+    }
+
+    bool SceneData::getIntersection(const Ray &ray, Intersection &result, TraversalStats &stats) const
+    {
+        return intersect(ray, result, stats);
+    }
+
+    template <class Stats>
+    bool SceneData::intersect(const Ray &ray, Intersection &result, Stats &stats) const
+    {
+        stats.countRay();
+
+        if (accelerationStructure_ == kProceduralInstances)
+            return getProceduralIntersection(ray, result, stats);
+
+        // A failed buildStructure leaves no BVH, the (empty) tree is walked then
+        if ((accelerationStructure_ == kWideBVH4 && wideBVH4_) || (accelerationStructure_ == kWideBVH8 && wideBVH8_)) {
+            double hit_t = std::numeric_limits<double>::max();
+            SphereIndex hitIdx;
+
+            bool hitFound = (accelerationStructure_ == kWideBVH4) ?
+                wideBVH4_->intersect(ray, spheresBatchIntersect_, hit_t, hitIdx, stats) :
+                wideBVH8_->intersect(ray, spheresBatchIntersect_, hit_t, hitIdx, stats);
+            if (hitFound)
+                setIntersection(ray, hit_t, getSphere(hitIdx), hitIdx, result);
+
+            return hitFound;
+        }
+
         bool hitFound = false;
 
         double min_t = std::numeric_limits<double>::max();
         double intersectionBoundSphere_t;
         double intersectionSphere_t;
+        SphereIndex hitIdx;
+
+        // The subtrees whose bounding sphere the ray gets in. The children of a node are pushed from
+        // the farthest to the closest, so the closest hits are found first and the subtrees that
+        // the ray gets in only after the closest hit so far are skipped without going inside.
+        struct PendingSubtree
+        {
+            SphereIndex rootIdx;
+            SphereIndex below;
+            unsigned int depth;
+            double entry_t;
+        } pending[kMaxPendingSubtrees];
+        unsigned int pendingCount = 0;
+
+        if (spheresCount_ > 0) {
+            Sphere rootSphere = getSphere(0);
+            Sphere rootBoundSphere(rootSphere.center, kBoundingSphereScale * rootSphere.radius);
+            stats.countBoundTests(1);
+            if (rootBoundSphere.intersectsEntry(ray, intersectionBoundSphere_t)) {
+                pending[0].rootIdx = 0;
+                pending[0].below = treeLevels_[0].blockSubtreeSize;
+                pending[0].depth = 0;
+                pending[0].entry_t = intersectionBoundSphere_t;
+                pendingCount = 1;
+            }
+        }
+
+        while (pendingCount > 0) {
+            const PendingSubtree subtree = pending[--pendingCount];
+            // Everything inside is farther than the closest hit
+            if (subtree.entry_t >= min_t) {
+                stats.countSkippedSubtrees(1);
+                continue;
+            }
+
+            SphereIndex subtreeSize = treeLevels_[subtree.depth].subtreeSize;
+            if (subtreeSize <= kMaxBatchedSubtreeSize) {
+                // The subtree is small - test all the spheres inside at once instead of walking it
+                stats.countSphereTests((unsigned int)subtreeSize);
+                if (spheresBatchIntersect_(tree_, subtree.rootIdx, (unsigned int)subtreeSize, ray, min_t, hitIdx)) {
+                    stats.countHit();
+                    hitFound = true;
+                }
+                continue;
+            }
+
+            // We are just interested if we have an intersect and its intersectionSphere_t
+            // value. The intersection point itself is calculated only for the closest hit.
+            // This is because distance to intersection = length(intersection - origin) = 
+            // length((intersectionSphere_t * ray.direction + origin) - origin) ==
+            // length(intersectionSphere_t * ray.direction) and this is propotional to intersectionSphere_t
+            Sphere sphereObj = getSphere(subtree.rootIdx);
+            stats.countSphereTests(1);
+            if (sphereObj.intersects(ray, intersectionSphere_t) && intersectionSphere_t < min_t) {
+                stats.countHit();
+                min_t = intersectionSphere_t;
+                hitIdx = subtree.rootIdx;
+                hitFound = true;
+            }
+
+            // The children are the same distance apart in tree_, every one of them with a subtree of the same size
+            const TreeLevel &childLevel = treeLevels_[subtree.depth + 1];
+            SphereIndex childIdx = subtree.rootIdx;
+            SphereIndex childBelow = subtree.below;
+            moveToFirstChild(childLevel, childIdx, childBelow);
+            unsigned int firstChild = pendingCount;
+            for (int i = 0; i < 9; i++) {
+                Sphere childSphere = getSphere(childIdx);
+                Sphere boundSphere(childSphere.center, kBoundingSphereScale * childSphere.radius);
+                if (boundSphere.intersectsEntry(ray, intersectionBoundSphere_t) && intersectionBoundSphere_t < min_t) {
+                    pending[pendingCount].rootIdx = childIdx;
+                    pending[pendingCount].below = childBelow;
+                    pending[pendingCount].depth = subtree.depth + 1;
+                    pending[pendingCount].entry_t = intersectionBoundSphere_t;
+                    pendingCount++;
+                }
+                childIdx += childLevel.siblingStride;
+                childBelow += childLevel.belowSiblingStride;
+            }
+            stats.countBoundTests(9);
+            stats.countSkippedSubtrees(9 - (pendingCount - firstChild));
+            sortFarthestFirst(pending + firstChild, pendingCount - firstChild);
+        }
+
+        if (hitFound)
+            setIntersection(ray, min_t, getSphere(hitIdx), hitIdx, result);
+
+        return hitFound;
+    }
+
+    void SceneData::getIntersections(const Ray *rays, unsigned int raysCount, Intersection *results, bool *hits) const
+    {
+        typedef unsigned long long RaysMask;
+
+        // The other structures trace every ray on its own
+        if (accelerationStructure_ != kSkipListTree) {
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++)
+                hits[rayIdx] = getIntersection(rays[rayIdx], results[rayIdx]);
+            return;
+        }
+
+        double min_t[kMaxPacketSize];
+        SphereIndex hitIdx[kMaxPacketSize];
+        for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+            min_t[rayIdx] = std::numeric_limits<double>::max();
+            hits[rayIdx] = false;
+        }
+
+        // Only the rays that hit the bounding spheres of all the parents are tested in a subtree.
+        // When we leave the subtree the rays of its parent become active again.
+        struct ParentSubtree
+        {
+            SphereIndex idx;
+            SphereIndex below;
+            // The rays that got in the parent
+            RaysMask activeRays;
+            unsigned int childrenLeft;
+        } parents[kMaxTraversalDepth];
+        unsigned int parentsCount = 0;
+
+        RaysMask activeRays = (raysCount == kMaxPacketSize) ? ~RaysMask(0) : (RaysMask(1) << raysCount) - 1;
+
+        double intersection_t;
+
+        // The tree is scanned from the root, going in the subtrees some rays get in and skipping the others
+        SphereIndex scanIndex = 0;
+        bool scanning = spheresCount_ > 0;
+        SphereIndex belowIndex = scanning ? treeLevels_[0].blockSubtreeSize : 0;
+        while (scanning) {
+            if (parentsCount > 0)
+                activeRays = parents[parentsCount - 1].activeRays;
+
+            Sphere sphereObj = getSphere(scanIndex);
+            Sphere boundSphere(sphereObj.center, kBoundingSphereScale * sphereObj.radius);
+            // Every parent on the stack is a level above the node
+            SphereIndex subtreeSize = treeLevels_[parentsCount].subtreeSize;
 
-        unsigned int scanIndex = 0;
-        while (scanIndex < spheresCount_) {
-            if (!tree_[scanIndex].boundSphere.intersects(ray, intersectionBoundSphere_t)) {
-                // Skip the entire sub tree and the spheres inside
-                scanIndex += tree_[scanIndex].nextSiblingInc;
+            // The node is fetched once for the whole packet. The rays that get in
+            // the bounding sphere only after their closest hit so far skip the subtree.
+            RaysMask boundHits = 0;
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                if ((activeRays >> rayIdx) & 1) {
+                    if (boundSphere.intersectsEntry(rays[rayIdx], intersection_t) && intersection_t < min_t[rayIdx])
+                        boundHits |= RaysMask(1) << rayIdx;
+                }
+            }
+
+            if (boundHits == 0) {
+                // None of the rays gets in - skip the entire sub tree
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
+            } else if (subtreeSize <= kMaxBatchedSubtreeSize) {
+                for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                    if ((boundHits >> rayIdx) & 1) {
+                        if (spheresBatchIntersect_(tree_, scanIndex, (unsigned int)subtreeSize, rays[rayIdx], min_t[rayIdx], hitIdx[rayIdx]))
+                            hits[rayIdx] = true;
+                    }
+                }
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
             } else {
-                // We are just interested if we have an intersect and its intersectionSphere_t
-                // value. Only if we have better intersectionSphere_t we bother to calculate 
-                // the intersection point itself.
-                // This is because distance to intersection = length(intersection - origin) = 
-                // length((intersectionSphere_t * ray.direction + origin) - origin) ==
-                // length(intersectionSphere_t * ray.direction) and this is propotional to intersectionSphere_t
-                if (tree_[scanIndex].sphereObj.intersects(ray, intersectionSphere_t)) {
-                    if (intersectionSphere_t < min_t) {
-                        min_t = intersectionSphere_t;
-
-                        result.point = intersectionSphere_t * ray.direction + ray.origin;
-                        result.surfaceNormal = (result.point - tree_[scanIndex].sphereObj.center) / tree_[scanIndex].sphereObj.radius;
-
-                        hitFound = true;
+                for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                    if ((boundHits >> rayIdx) & 1) {
+                        if (sphereObj.intersects(rays[rayIdx], intersection_t) && intersection_t < min_t[rayIdx]) {
+                            min_t[rayIdx] = intersection_t;
+                            hitIdx[rayIdx] = scanIndex;
+                            hits[rayIdx] = true;
+                        }
                     }
                 }
-                // Traverse all the siblings on that level as they are potential hits
-                // On the end of the the level (because of the ordering in tree_) we 
-                // will go to the next sibling sphere of the prev level
-                scanIndex++;
+
+                // Go down with just the rays that got in
+                parents[parentsCount].idx = scanIndex;
+                parents[parentsCount].below = belowIndex;
+                parents[parentsCount].activeRays = boundHits;
+                parents[parentsCount].childrenLeft = 9;
+                parentsCount++;
+                moveToFirstChild(treeLevels_[parentsCount], scanIndex, belowIndex);
             }
         }
 
+        // Only the closest hit of every ray is turned into a point and a normal
+        for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+            if (hits[rayIdx])
+                setIntersection(rays[rayIdx], min_t[rayIdx], getSphere(hitIdx[rayIdx]), hitIdx[rayIdx], results[rayIdx]);
+        }
+    }
+
+    bool SceneData::occluded(const Ray &ray, double maxT) const
+    {
+        if (accelerationStructure_ == kProceduralInstances)
+            return proceduralOccluded(ray, maxT);
+        if (accelerationStructure_ == kWideBVH4 && wideBVH4_)
+            return wideBVH4_->occluded(ray, spheresBatchIntersect_, maxT);
+        if (accelerationStructure_ == kWideBVH8 && wideBVH8_)
+            return wideBVH8_->occluded(ray, spheresBatchIntersect_, maxT);
+
+        double intersection_t;
+        SphereIndex hitIdx;
+
+        // The subtrees the scan is in, to know the depth of the node and where to go after it
+        struct ParentSubtree
+        {
+            SphereIndex idx;
+            SphereIndex below;
+            unsigned int childrenLeft;
+        } parents[kMaxTraversalDepth];
+        unsigned int parentsCount = 0;
+
+        // Any hit will do, so the tree is scanned in its own order skipping the subtrees 
+        // the ray misses or gets in only after maxT
+        SphereIndex scanIndex = 0;
+        bool scanning = spheresCount_ > 0;
+        SphereIndex belowIndex = scanning ? treeLevels_[0].blockSubtreeSize : 0;
+        while (scanning) {
+            Sphere sphereObj = getSphere(scanIndex);
+            Sphere boundSphere(sphereObj.center, kBoundingSphereScale * sphereObj.radius);
+            SphereIndex subtreeSize = treeLevels_[parentsCount].subtreeSize;
+
+            if (!boundSphere.intersectsEntry(ray, intersection_t) || intersection_t >= maxT) {
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
+            } else if (subtreeSize <= kMaxBatchedSubtreeSize) {
+                intersection_t = maxT;
+                if (spheresBatchIntersect_(tree_, scanIndex, (unsigned int)subtreeSize, ray, intersection_t, hitIdx))
+                    return true;
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
+            } else {
+                if (sphereObj.intersects(ray, intersection_t) && intersection_t < maxT)
+                    return true;
+                parents[parentsCount].idx = scanIndex;
+                parents[parentsCount].below = belowIndex;
+                parents[parentsCount].childrenLeft = 9;
+                parentsCount++;
+                moveToFirstChild(treeLevels_[parentsCount], scanIndex, belowIndex);
+            }
+        }
+
+        return false;
+    }
+
+    void SceneData::occluded(const Ray *rays, unsigned int raysCount, const double *maxTs, bool *results) const
+    {
+        typedef unsigned long long RaysMask;
+
+        for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++)
+            results[rayIdx] = false;
+
+        // The other structures check every ray on its own
+        if (accelerationStructure_ != kSkipListTree) {
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++)
+                results[rayIdx] = occluded(rays[rayIdx], maxTs[rayIdx]);
+            return;
+        }
+
+        // Like in getIntersections the rays that miss the bounding sphere of a node are left out of its 
+        // subtree. The rays that are found occluded are left out of everything, once there are none
+        // left we are done.
+        struct ParentSubtree
+        {
+            SphereIndex idx;
+            SphereIndex below;
+            // The rays that got in the parent
+            RaysMask activeRays;
+            unsigned int childrenLeft;
+        } parents[kMaxTraversalDepth];
+        unsigned int parentsCount = 0;
+
+        RaysMask pendingRays = (raysCount == kMaxPacketSize) ? ~RaysMask(0) : (RaysMask(1) << raysCount) - 1;
+        RaysMask activeRays = pendingRays;
+
+        double intersection_t;
+        SphereIndex hitIdx;
+
+        SphereIndex scanIndex = 0;
+        bool scanning = spheresCount_ > 0;
+        SphereIndex belowIndex = scanning ? treeLevels_[0].blockSubtreeSize : 0;
+        while (scanning && pendingRays != 0) {
+            if (parentsCount > 0)
+                activeRays = parents[parentsCount - 1].activeRays;
+            activeRays &= pendingRays;
+
+            Sphere sphereObj = getSphere(scanIndex);
+            Sphere boundSphere(sphereObj.center, kBoundingSphereScale * sphereObj.radius);
+            SphereIndex subtreeSize = treeLevels_[parentsCount].subtreeSize;
+
+            RaysMask boundHits = 0;
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                if ((activeRays >> rayIdx) & 1) {
+                    if (boundSphere.intersectsEntry(rays[rayIdx], intersection_t) && intersection_t < maxTs[rayIdx])
+                        boundHits |= RaysMask(1) << rayIdx;
+                }
+            }
+
+            if (boundHits == 0) {
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
+                continue;
+            }
+
+            for (unsigned int rayIdx = 0; rayIdx < raysCount; rayIdx++) {
+                if ((boundHits >> rayIdx) & 1) {
+                    bool hit;
+                    if (subtreeSize <= kMaxBatchedSubtreeSize) {
+                        intersection_t = maxTs[rayIdx];
+                        hit = spheresBatchIntersect_(tree_, scanIndex, (unsigned int)subtreeSize, rays[rayIdx], intersection_t, hitIdx);
+                    } else {
+                        hit = sphereObj.intersects(rays[rayIdx], intersection_t) && intersection_t < maxTs[rayIdx];
+                    }
+                    if (hit) {
+                        results[rayIdx] = true;
+                        pendingRays &= ~(RaysMask(1) << rayIdx);
+                    }
+                }
+            }
+
+            if (subtreeSize <= kMaxBatchedSubtreeSize) {
+                scanning = skipSubtree(treeLevels_, parents, parentsCount, scanIndex, belowIndex);
+            } else {
+                // Go down with just the rays that got in
+                parents[parentsCount].idx = scanIndex;
+                parents[parentsCount].below = belowIndex;
+                parents[parentsCount].activeRays = boundHits;
+                parents[parentsCount].childrenLeft = 9;
+                parentsCount++;
+                moveToFirstChild(treeLevels_[parentsCount], scanIndex, belowIndex);
+            }
+        }
+    }
+
+    Sphere SceneData::generateSphere(SphereIndex idx) const
+    {
+        glm::dvec3 center(0, 0, 0);
+        glm::dvec3 up(0, 1, 0);
+        double radius = 1.0;
+
+        // Go down to the child whose subtree has the node, the same way create() does
+        SphereIndex nodeIdx = 0;
+        SphereIndex below = treeLevels_[0].blockSubtreeSize;
+        unsigned int depth = 0;
+        while (nodeIdx != idx) {
+            // The node is either in the block of the current one or below it
+            const TreeLevel &childLevel = treeLevels_[depth + 1];
+            unsigned int childIdx = (idx < below) ?
+                (unsigned int)((idx - nodeIdx - 1) / childLevel.siblingStride) :
+                (unsigned int)((idx - below) / childLevel.belowSiblingStride);
+
+            glm::dvec3 tangentDirection = SphereBasis(up).childDirection(childIdx);
+            double newRadius = radius / 3;
+
+            center = center + (tangentDirection * (radius + newRadius));
+            up = tangentDirection;
+            radius = newRadius;
+
+            moveToFirstChild(childLevel, nodeIdx, below);
+            nodeIdx += childIdx * childLevel.siblingStride;
+            below += childIdx * childLevel.belowSiblingStride;
+            depth++;
+        }
+
+        return Sphere(center, radius);
+    }
+
+    template <class Stats>
+    bool SceneData::getProceduralIntersection(const Ray &ray, Intersection &result, Stats &stats) const
+    {
+        // The spheres whose bounding sphere the ray gets in, generated from their parent when it's
+        // visited. Like in the tree the closest ones are visited first. Only the siblings of the spheres
+        // on the current path are kept, so this is all the memory the traversal needs.
+        struct PendingSphere
+        {
+            glm::dvec3 center;
+            glm::dvec3 up;
+            double radius;
+            unsigned int level;
+            // Where the sphere would be in the tree
+            SphereIndex idx;
+            SphereIndex below;
+            double entry_t;
+        } pending[kMaxPendingSubtrees];
+        unsigned int pendingCount = 0;
+
+        bool hitFound = false;
+        double min_t = std::numeric_limits<double>::max();
+        double intersection_t;
+        Sphere hitSphere;
+        SphereIndex hitIdx = 0;
+
+        // Start from the root
+        Sphere rootBoundSphere(glm::dvec3(0, 0, 0), kBoundingSphereScale * 1.0);
+        stats.countBoundTests(1);
+        if (levels_ > 0 && rootBoundSphere.intersectsEntry(ray, intersection_t)) {
+            pending[0].center = glm::dvec3(0, 0, 0);
+            pending[0].up = glm::dvec3(0, 1, 0);
+            pending[0].radius = 1.0;
+            pending[0].level = 0;
+            pending[0].idx = 0;
+            pending[0].below = treeLevels_[0].blockSubtreeSize;
+            pending[0].entry_t = intersection_t;
+            pendingCount = 1;
+        }
+
+        while (pendingCount > 0) {
+            const PendingSphere sphere = pending[--pendingCount];
+            // It and its children are farther than the closest hit
+            if (sphere.entry_t >= min_t) {
+                stats.countSkippedSubtrees(1);
+                continue;
+            }
+
+            Sphere sphereObj(sphere.center, sphere.radius);
+            stats.countSphereTests(1);
+            if (sphereObj.intersects(ray, intersection_t) && intersection_t < min_t) {
+                stats.countHit();
+                min_t = intersection_t;
+                hitSphere = sphereObj;
+                hitIdx = sphere.idx;
+                hitFound = true;
+            }
+
+            if (sphere.level + 1 >= levels_)
+                continue;
+
+            SphereBasis basis(sphere.up);
+            double newRadius = sphere.radius / 3;
+            const TreeLevel &childLevel = treeLevels_[sphere.level + 1];
+            SphereIndex childIdx = sphere.idx;
+            SphereIndex childBelow = sphere.below;
+            moveToFirstChild(childLevel, childIdx, childBelow);
+
+            unsigned int firstChild = pendingCount;
+            for (int i = 0; i < 9; i++) {
+                glm::dvec3 tangentDirection = basis.childDirection(i);
+                glm::dvec3 center = sphere.center + (tangentDirection * (sphere.radius + newRadius));
+
+                Sphere boundSphere(center, kBoundingSphereScale * newRadius);
+                if (boundSphere.intersectsEntry(ray, intersection_t) && intersection_t < min_t) {
+                    PendingSphere &child = pending[pendingCount++];
+                    child.center = center;
+                    child.up = tangentDirection;
+                    child.radius = newRadius;
+                    child.level = sphere.level + 1;
+                    child.idx = childIdx + i * childLevel.siblingStride;
+                    child.below = childBelow + i * childLevel.belowSiblingStride;
+                    child.entry_t = intersection_t;
+                }
+            }
+            stats.countBoundTests(9);
+            stats.countSkippedSubtrees(9 - (pendingCount - firstChild));
+            sortFarthestFirst(pending + firstChild, pendingCount - firstChild);
+        }
+
+        // The sphere is kept along with its index, generating it again from the index would mean walking down the tree
+        if (hitFound)
+            setIntersection(ray, min_t, hitSphere, hitIdx, result);
+
         return hitFound;
     }
+
+    bool SceneData::proceduralOccluded(const Ray &ray, double maxT) const
+    {
+        // Like getProceduralIntersection, but the children are visited in whatever order they come
+        struct PendingSphere
+        {
+            glm::dvec3 center;
+            glm::dvec3 up;
+            double radius;
+            unsigned int level;
+        } pending[kMaxPendingSubtrees];
+        unsigned int pendingCount = 0;
+
+        double intersection_t;
+
+        Sphere rootBoundSphere(glm::dvec3(0, 0, 0), kBoundingSphereScale * 1.0);
+        if (levels_ > 0 && rootBoundSphere.intersectsEntry(ray, intersection_t) && intersection_t < maxT) {
+            pending[0].center = glm::dvec3(0, 0, 0);
+            pending[0].up = glm::dvec3(0, 1, 0);
+            pending[0].radius = 1.0;
+            pending[0].level = 0;
+            pendingCount = 1;
+        }
+
+        while (pendingCount > 0) {
+            const PendingSphere sphere = pending[--pendingCount];
+
+            Sphere sphereObj(sphere.center, sphere.radius);
+            if (sphereObj.intersects(ray, intersection_t) && intersection_t < maxT)
+                return true;
+
+            if (sphere.level + 1 >= levels_)
+                continue;
+
+            SphereBasis basis(sphere.up);
+            double newRadius = sphere.radius / 3;
+
+            for (int i = 0; i < 9; i++) {
+                glm::dvec3 tangentDirection = basis.childDirection(i);
+                glm::dvec3 center = sphere.center + (tangentDirection * (sphere.radius + newRadius));
+
+                Sphere boundSphere(center, kBoundingSphereScale * newRadius);
+                if (boundSphere.intersectsEntry(ray, intersection_t) && intersection_t < maxT) {
+                    PendingSphere &child = pending[pendingCount++];
+                    child.center = center;
+                    child.up = tangentDirection;
+                    child.radius = newRadius;
+                    child.level = sphere.level + 1;
+                }
+            }
+        }
+
+        return false;
+    }
 }
\ No newline at end of file
@@ -1,11 +1,26 @@
 #ifndef SCENEDATA_H
 #define SCENEDATA_H
 
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <QString>
+
 #include <glm/vec3.hpp>
-#include <glm/mat4x4.hpp>
+
+#include "cancellationtoken.h"
+#include "nodememory.h"
+#include "spherekernels.h"
+#include "traversalstats.h"
+
+class QFile;
 
 namespace MyRaytracer
 {
+    class ThreadPool;
+    template <unsigned int Width> class WideBVH;
+
     struct Ray
     {
         glm::dvec3 origin;
@@ -16,6 +31,8 @@ namespace MyRaytracer
     {
         glm::dvec3 point;
         glm::dvec3 surfaceNormal;
+        // The index of the sphere hit in the sphereflake tree
+        SphereIndex sphereIdx;
     };
 
     struct Sphere
@@ -26,28 +43,78 @@ namespace MyRaytracer
         // Checks if a ray intersects a sphere and returns just the 
         // scalar t in vect' = vect * t + origin
         bool intersects(const Ray &, double &) const;
+        // Checks if a ray intersects a sphere and returns the t it gets in
+        // the sphere at (0 if the origin of the ray is inside the sphere)
+        bool intersectsEntry(const Ray &, double &) const;
 
         glm::dvec3 center;
         double radius;
     };
 
-    struct BVHNode 
+#ifdef SPHEREFLAKE_FLOAT_STORAGE
+    // The spheres are stored in single precision, the intersection math is still done in double
+    typedef float StorageReal;
+#else
+    typedef double StorageReal;
+#endif
+
+    // The bounding sphere of a node shares the center of the node's sphere.
+    // It bounds all the child spheres and their children with a two times bigger radius.
+    const double kBoundingSphereScale = 2.0;
+
+    // BVH tree nodes stored as a structure of arrays - node i is the i-th element of every array.
+    // The traversal touches just the arrays it needs and the data of consecutive nodes is packed together.
+    // The size of a subtree depends only on the depth of its root, so it isn't stored per node - the
+    // traversals know the depth they are at and take the size from a table with an entry per level.
+    //
+    // The nodes are in depth-first order within blocks of a few levels of the tree. After a block come
+    // the subtrees hanging below it, one after the other in the order of their parents and every one of
+    // them laid out the same way. The traversals carry along with every node where the part of its subtree
+    // below its block starts. By default the whole tree is a single block, which is just the depth-first order.
+    struct BVHNodes
+    {
+        BVHNodes() : centerX(nullptr), centerY(nullptr), centerZ(nullptr), radius(nullptr) {}
+
+        StorageReal *centerX;
+        StorageReal *centerY;
+        StorageReal *centerZ;
+        StorageReal *radius;
+    };
+
+    // How the subtrees of the nodes at one depth of the tree are laid out
+    struct TreeLevel
     {
-        BVHNode() : nextSiblingInc(0) {}
-        BVHNode(const Sphere &boundSphere, const Sphere &sphereObj, unsigned int nextSiblingInc) : 
-            boundSphere(boundSphere), sphereObj(sphereObj), nextSiblingInc(nextSiblingInc) {}
+        // The number of nodes in the subtree of a node
+        SphereIndex subtreeSize;
+        // How many of them are in the block of the node, right after it. The rest of them are below the block.
+        SphereIndex blockSubtreeSize;
+        // The distances from a node and from the part of its subtree below the block to those of its next sibling
+        SphereIndex siblingStride;
+        SphereIndex belowSiblingStride;
+        // The nodes start new blocks, their parents are at the bottom of the block above
+        bool blockRoot;
+    };
 
-        Sphere boundSphere, sphereObj;
-        unsigned int nextSiblingInc;
+    // The structures getIntersection can use to find the spheres hit by a ray
+    enum AccelerationStructure
+    {
+        // The sphereflake tree itself walked as a skip list
+        kSkipListTree,
+        // Wide BVHs with tight boxes built over the spheres of the tree
+        kWideBVH4,
+        kWideBVH8,
+        // No tree at all - the spheres are generated from their parents while the rays
+        // walk the sphereflake. Needs memory just for the levels, not for the spheres.
+        kProceduralInstances
     };
 
     class SceneData
     {
     public:
-        SceneData();
+        SceneData(ThreadPool &threadPool);
         ~SceneData();
 
-        // Creates a BVH tree of the spheres
+        // Creates a BVH tree of the spheres (unless the procedural instances are used)
         bool buildStructure(unsigned int levels);
         // Cleans the scene and deallocates all the memory
         void clear();
@@ -55,45 +122,158 @@ namespace MyRaytracer
         glm::dvec3 lightPos() const { return lightPos_; }
         void setLightPos(const glm::dvec3 &newPos) { lightPos_ = newPos; }
 
-        // Applies a matrix transformation to all the spheres
-        void transformPoints(const glm::dmat4 &transformMatrix); 
-
-        // Finds the first intersection of a ray and the structure of spheres
+        // Finds the first intersection of a ray and the structure of spheres.
+        // The structure is never changed after it is built, so this can be called from many threads.
         bool getIntersection(const Ray &ray, Intersection &result) const;
+        // The same, also adding up what the traversal did in stats. A bit slower than the one above.
+        bool getIntersection(const Ray &ray, Intersection &result, TraversalStats &stats) const;
+
+        // The largest packet of rays getIntersections can trace at once
+        static const unsigned int kMaxPacketSize = 64;
+
+        // Finds the first intersection of every ray in a packet. The rays walk the tree together and
+        // a subtree is skipped only when none of them hits its bounding sphere, so the packet should
+        // be made of coherent rays (e.g. the primary rays of neighbouring pixels).
+        // hits[i] tells if results[i] was found.
+        void getIntersections(const Ray *rays, unsigned int raysCount, Intersection *results, bool *hits) const;
+
+        // Checks if a ray hits any sphere closer than maxT. Stops at the first one found and skips
+        // everything farther than maxT, so it's much cheaper than finding the closest hit. A ray
+        // starting on a surface (e.g. towards the light) should be moved off it first.
+        bool occluded(const Ray &ray, double maxT) const;
+        // Checks up to kMaxPacketSize rays at once, results[i] tells if rays[i] hits something 
+        // closer than maxTs[i]. Like getIntersections it suits coherent rays best.
+        void occluded(const Ray *rays, unsigned int raysCount, const double *maxTs, bool *results) const;
+
+        // Returns the sphere stored in a node of the tree. Without a tree (the procedural 
+        // instances) the sphere is generated, walking down from the root to the node.
+        Sphere getSphere(SphereIndex idx) const {
+            if (!tree_.radius)
+                return generateSphere(idx);
+            return Sphere(glm::dvec3(tree_.centerX[idx], tree_.centerY[idx], tree_.centerZ[idx]), tree_.radius[idx]);
+        }
+
+        // Chooses the instruction set used to intersect rays with many spheres at once.
+        // By default the best one supported by the CPU is used.
+        void setSpheresKernelIsa(SpheresKernelIsa isa);
+        SpheresKernelIsa getSpheresKernelIsa() const { return spheresKernelIsa_; }
+
+        // Chooses the structure used to intersect rays with the spheres. The wide BVHs are built when needed.
+        // Returns false if the structure can't be built, the previous one stays in use then. The choice is kept
+        // through a failed buildStructure and its BVH is built again with the next tree. Until then the rays
+        // walk the empty tree and hit nothing.
+        bool setAccelerationStructure(AccelerationStructure accelerationStructure);
+        AccelerationStructure getAccelerationStructure() const { return accelerationStructure_; }
 
         // Gets the number of spheres in this specific structure
-        unsigned int getSpheresCount() const { return spheresCount_; }
+        SphereIndex getSpheresCount() const { return spheresCount_; }
+        // Changes every time the spheres are rebuilt, so that whatever is derived from them can be dropped
+        unsigned int getVersion() const { return version_; }
 
         // Returns how much sphere we have for a construction with specified levels
-        static unsigned int getSpheresCount(unsigned int level);
+        static SphereIndex getSpheresCount(unsigned int level);
+
+        // With a cache directory every tree built is written to a file there. The next time the same tree
+        // is needed (e.g. after a restart) the file is mapped to memory and used as it is, without building
+        // anything. The processes using the same file share the memory it takes. The file is written on
+        // a thread of its own after the tree is built, clearing the scene stops the writing.
+        void setTreeCacheDirectory(const QString &directory) { treeCacheDirectory_ = directory; }
+        QString getTreeCacheDirectory() const { return treeCacheDirectory_; }
+        // Waits until the tree is written to its cache file, e.g. before the process exits
+        void waitForTreeCache();
+
+        // Chooses how the memory of the tree is allocated (a combination of NodeMemoryFlags).
+        // Used from the next time the tree is built. The trees mapped from the cache are not affected.
+        void setNodeMemoryFlags(unsigned int flags) { nodeMemoryFlags_ = flags; }
+        unsigned int getNodeMemoryFlags() const { return nodeMemoryFlags_; }
 
     private:
+        // Generates the sphere of a node of the tree
+        Sphere generateSphere(SphereIndex idx) const;
+        // Finds the first intersection in the current structure counting what it does with stats
+        template <class Stats>
+        bool intersect(const Ray &ray, Intersection &result, Stats &stats) const;
+        // Finds the first intersection generating the spheres on the fly
+        template <class Stats>
+        bool getProceduralIntersection(const Ray &ray, Intersection &result, Stats &stats) const;
+        // Checks for any intersection closer than maxT generating the spheres on the fly
+        bool proceduralOccluded(const Ray &ray, double maxT) const;
+
         // Disables copying and assigning
         SceneData &operator=(const SceneData &);
         SceneData(const SceneData &);
 
-        // Crates a sphere on a specific level and inserts it the the tree
-        void create(unsigned int level, unsigned int idx, unsigned int nextSiblingInc,
-            const glm::dvec3 &center, const glm::dvec3 &up, double radius);
+        // Where a subtree goes in the tree and the sphere at its root
+        struct SubtreeRoot
+        {
+            unsigned int level;
+            SphereIndex idx;
+            SphereIndex below;
+            glm::dvec3 center;
+            glm::dvec3 up;
+            double radius;
+        };
 
-        // Functor that allows the parallelisation of spheres transformation
-        struct TransformPointsParallelTask
+        // Functor that creates a range of subtrees, so that the tree is filled in parallel
+        struct CreateSubtreesTask
         {
         public:
-            TransformPointsParallelTask(SceneData& outer, const glm::dmat4 &transformMatrix) : 
-                outer_(outer), transformMatrix_(transformMatrix) {}
-            // Traverse the range of spheres and transforms them
-            void operator()(unsigned int taskSphereStartIdx, unsigned int taskSphereEndIdx);
+            CreateSubtreesTask(SceneData &outer, const std::vector<SubtreeRoot> &roots) : outer_(outer), roots_(roots) {}
+            void operator()(unsigned int startIdx, unsigned int endIdx);
+
         private:
-            glm::dmat4 transformMatrix_;
             SceneData &outer_;
+            const std::vector<SubtreeRoot> &roots_;
         };
 
-        // BVH tree represented as an array
-        BVHNode *tree_;
+        // Crates a sphere on a specific level and inserts it the the tree. below is where the part of its subtree
+        // below its block starts. If deferredRoots is passed the subtrees at deferredLevel are not created, just added to it.
+        void create(unsigned int level, SphereIndex idx, SphereIndex below,
+            const glm::dvec3 &center, const glm::dvec3 &up, double radius,
+            std::vector<SubtreeRoot> *deferredRoots = nullptr, unsigned int deferredLevel = 0);
+
+        ThreadPool &threadPool_;
+
+        SpheresKernelIsa spheresKernelIsa_;
+        SpheresBatchIntersectFunc spheresBatchIntersect_;
+
+        // Allocates all the node arrays in a single block
+        bool allocateNodes(SphereIndex nodesCount);
+        // Allocates and fills the tree for the current number of levels
+        bool materializeTree();
+        // Fills the allocated tree, in parallel if it's big enough
+        bool createTree();
+        // Returns the cache file of the tree with the current number of levels
+        QString getTreeCacheFileName() const;
+        // Maps the tree from its cache file. Returns false if the file is not there or it's out of date.
+        bool loadTreeCache();
+        // Writes the tree to a cache file. Gives up if treeCacheWriteCancellation_ is raised.
+        bool saveTreeCache(const QString &fileName) const;
+        // Starts writing the tree to its cache file on treeCacheWriter_
+        void startTreeCacheWrite();
+        // Stops the writing of the cache file and waits for the thread to finish
+        void stopTreeCacheWrite();
+        // Builds the tree or the wide BVH an acceleration structure needs if they are not there yet
+        bool buildAccelerationStructure(AccelerationStructure accelerationStructure);
+
+        // BVH tree represented as arrays. They are either in treeMemory_ or in the memory mapped from treeCacheFile_.
+        BVHNodes tree_;
+        NodeMemory treeMemory_;
+        unsigned int nodeMemoryFlags_;
+        std::unique_ptr<QFile> treeCacheFile_;
+        QString treeCacheDirectory_;
+        std::thread treeCacheWriter_;
+        CancellationToken treeCacheWriteCancellation_;
+
+        AccelerationStructure accelerationStructure_;
+        std::unique_ptr<WideBVH<4> > wideBVH4_;
+        std::unique_ptr<WideBVH<8> > wideBVH8_;
 
         unsigned int levels_;
-        unsigned int spheresCount_;
+        SphereIndex spheresCount_;
+        // The layout of the subtrees whose root is at a depth, the whole tree is at 0
+        std::vector<TreeLevel> treeLevels_;
+        unsigned int version_;
 
         glm::dvec3 lightPos_;
     };
@@ -1,9 +1,36 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
-// the dimension of the OpenGL widget
-const unsigned int kSceneWidth = 800;
-const unsigned int kSceneHeight = 600;
+// the initial dimension of the OpenGL widget and of the frames rendered
+const unsigned int kDefaultSceneWidth = 800;
+const unsigned int kDefaultSceneHeight = 600;
+
+// the size of the square screen tiles the frame is split into when rendering
+const unsigned int kDefaultTileSize = 16;
+// the size of the square blocks of pixels whose rays are traced together (1 means no packets)
+const unsigned int kDefaultPacketSize = 4;
+
+// the difference in intensity (0 to 1) between two neighbouring pixels that
+// makes the adaptive anti-aliasing take more samples for them
+const double kAdaptiveAntiAliasingThreshold = 0.05;
+
+// the progressive rendering starts with a ray per 4x4 pixels and halves that until it gets to the real frame
+const unsigned int kCoarsestPreviewPixelStep = 4;
+// how long the camera has to stay still before the progressive rendering starts refining the frame
+const int kRefinementDelayMs = 100;
+
+// the deepest sphereflake whose spheres are all kept in memory (435 million spheres, 14 GB in double precision)
+const unsigned int kMaxMaterializedLevels = 10;
+// the deepest sphereflake generated on the fly, the deeper ones take too long to render
+const unsigned int kMaxProceduralLevels = 12;
+
+// the cost heatmap is red for the pixels whose rays do that many bound and sphere tests or more
+const double kHeatmapMaxCost = 4096;
+
+// where the light is relative to the camera, the light control turns it around the vertical axis
+const double kDefaultLightPosX = -0.6;
+const double kDefaultLightPosY = 5;
+const double kDefaultLightPosZ = -10;
 
 // camera move speed
 const double kMovementSpeed = 0.2;
@@ -0,0 +1,38 @@
+# The renderer itself - the scene, the ray tracer, the camera and everything they need.
+# Shared by the GUI and the command-line tools, none of it depends on Qt widgets.
+
+CONFIG += c++11
+
+INCLUDEPATH += $$PWD $$PWD/glm
+
+# Uncomment to store the spheres in single precision (half the memory, slightly less accurate)
+#DEFINES += SPHEREFLAKE_FLOAT_STORAGE
+# Uncomment to store the tree in blocks of a few levels instead of the depth-first order (fewer cache misses in big trees)
+#DEFINES += SPHEREFLAKE_CLUSTERED_TREE
+
+SOURCES += \
+    $$PWD/camera.cpp \
+    $$PWD/nodememory.cpp \
+    $$PWD/optionparsing.cpp \
+    $$PWD/raytraycer.cpp \
+    $$PWD/scenedata.cpp \
+    $$PWD/spherekernels.cpp \
+    $$PWD/spherekernels_avx2.cpp \
+    $$PWD/spherekernels_avx512.cpp \
+    $$PWD/threadpool.cpp \
+    $$PWD/widebvh.cpp
+
+HEADERS += \
+    $$PWD/asyncrunner.h \
+    $$PWD/cancellationtoken.h \
+    $$PWD/camera.h \
+    $$PWD/nodememory.h \
+    $$PWD/optionparsing.h \
+    $$PWD/raytracer.h \
+    $$PWD/scenedata.h \
+    $$PWD/settings.h \
+    $$PWD/spherekernels.h \
+    $$PWD/spherekernels_impl.h \
+    $$PWD/threadpool.h \
+    $$PWD/traversalstats.h \
+    $$PWD/widebvh.h
@@ -0,0 +1,113 @@
+#include "scenedata.h"
+#include "spherekernels.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPHEREFLAKE_HAS_SSE2_KERNEL
+#include <emmintrin.h>
+#include "spherekernels_impl.h"
+#endif
+
+namespace MyRaytracer
+{
+#ifdef SPHEREFLAKE_HAS_SSE2_KERNEL
+    namespace
+    {
+        struct Sse2Vectors
+        {
+            typedef double Real;
+            typedef __m128d Vec;
+            typedef __m128d Mask;
+            static const unsigned int kWidth = 2;
+
+            static Vec set1(Real x) { return _mm_set1_pd(x); }
+            static Vec load(const double *p) { return _mm_loadu_pd(p); }
+            static Vec load(const float *p) { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)))); }
+            static void store(Real *p, Vec v) { _mm_storeu_pd(p, v); }
+            static Vec add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+            static Vec sub(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+            static Vec mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+            static Vec max(Vec a, Vec b) { return _mm_max_pd(a, b); }
+            static Vec sqrt(Vec a) { return _mm_sqrt_pd(a); }
+            static Mask greater(Vec a, Vec b) { return _mm_cmpgt_pd(a, b); }
+            static Mask greaterOrEqual(Vec a, Vec b) { return _mm_cmpge_pd(a, b); }
+            static Mask logicalAnd(Mask a, Mask b) { return _mm_and_pd(a, b); }
+            static Vec select(Mask m, Vec a, Vec b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+        };
+    }
+#endif
+
+    namespace SpheresKernels
+    {
+        bool intersectScalar(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                             const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            bool hitFound = false;
+            double sphere_t;
+
+            for (SphereIndex nodeIdx = firstIdx; nodeIdx < firstIdx + count; nodeIdx++) {
+                Sphere sphere(glm::dvec3(nodes.centerX[nodeIdx], nodes.centerY[nodeIdx], nodes.centerZ[nodeIdx]), nodes.radius[nodeIdx]);
+                if (sphere.intersects(ray, sphere_t) && sphere_t < t) {
+                    t = sphere_t;
+                    hitIdx = nodeIdx;
+                    hitFound = true;
+                }
+            }
+
+            return hitFound;
+        }
+
+        bool intersectSse2(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                           const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+#ifdef SPHEREFLAKE_HAS_SSE2_KERNEL
+            return intersectSpheresBatch<Sse2Vectors>(nodes, firstIdx, count, ray, t, hitIdx);
+#else
+            return intersectScalar(nodes, firstIdx, count, ray, t, hitIdx);
+#endif
+        }
+    }
+
+    SpheresKernelIsa detectSpheresKernelIsa()
+    {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return kAvx512Kernel;
+        if (__builtin_cpu_supports("avx2"))
+            return kAvx2Kernel;
+#endif
+#ifdef SPHEREFLAKE_HAS_SSE2_KERNEL
+        return kSse2Kernel;
+#else
+        return kScalarKernel;
+#endif
+    }
+
+    SpheresBatchIntersectFunc getSpheresBatchIntersect(SpheresKernelIsa isa)
+    {
+        switch (isa) {
+        case kSse2Kernel:
+            return SpheresKernels::intersectSse2;
+        case kAvx2Kernel:
+            return SpheresKernels::intersectAvx2;
+        case kAvx512Kernel:
+            return SpheresKernels::intersectAvx512;
+        default:
+            return SpheresKernels::intersectScalar;
+        }
+    }
+
+    const char *getSpheresKernelIsaName(SpheresKernelIsa isa)
+    {
+        switch (isa) {
+        case kSse2Kernel:
+            return "SSE2";
+        case kAvx2Kernel:
+            return "AVX2";
+        case kAvx512Kernel:
+            return "AVX-512";
+        default:
+            return "scalar";
+        }
+    }
+}
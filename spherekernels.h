@@ -0,0 +1,44 @@
+#ifndef SPHEREKERNELS_H
+#define SPHEREKERNELS_H
+
+namespace MyRaytracer
+{
+    struct BVHNodes;
+    struct Ray;
+
+    // The index of a sphere in the sphereflake tree. The deep trees have more spheres than 32 bits can count.
+    typedef unsigned long long SphereIndex;
+
+    // Tests one ray against count consecutive spheres of the tree starting at firstIdx.
+    // On input t is the distance of the closest hit found so far. If a sphere is hit closer
+    // than that, t and hitIdx are updated with the closest such hit and true is returned.
+    typedef bool (*SpheresBatchIntersectFunc)(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                                              const Ray &ray, double &t, SphereIndex &hitIdx);
+
+    // The different implementations of the batch intersection, one per instruction set
+    enum SpheresKernelIsa
+    {
+        kScalarKernel,
+        kSse2Kernel,
+        kAvx2Kernel,
+        kAvx512Kernel
+    };
+
+    // Returns the best instruction set supported by the CPU we are running on
+    SpheresKernelIsa detectSpheresKernelIsa();
+    // Returns the batch intersection built for an instruction set
+    SpheresBatchIntersectFunc getSpheresBatchIntersect(SpheresKernelIsa isa);
+    const char *getSpheresKernelIsaName(SpheresKernelIsa isa);
+
+    // The implementations themselves. Every one of them lives in a separate translation unit,
+    // so that it can be compiled for its instruction set without affecting the rest of the code.
+    namespace SpheresKernels
+    {
+        bool intersectScalar(const BVHNodes &, SphereIndex, unsigned int, const Ray &, double &, SphereIndex &);
+        bool intersectSse2(const BVHNodes &, SphereIndex, unsigned int, const Ray &, double &, SphereIndex &);
+        bool intersectAvx2(const BVHNodes &, SphereIndex, unsigned int, const Ray &, double &, SphereIndex &);
+        bool intersectAvx512(const BVHNodes &, SphereIndex, unsigned int, const Ray &, double &, SphereIndex &);
+    }
+}
+
+#endif //SPHEREKERNELS_H
@@ -0,0 +1,80 @@
+// AVX2 version of the sphere kernels. Only the code in this file is compiled for AVX2,
+// it is called only after checking that the CPU supports it.
+
+#include <algorithm>
+#include <limits>
+
+#include "scenedata.h"
+#include "spherekernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHEREFLAKE_HAS_AVX2_KERNEL
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#include <immintrin.h>
+#include "spherekernels_impl.h"
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        struct Avx2Vectors
+        {
+            typedef double Real;
+            typedef __m256d Vec;
+            typedef __m256d Mask;
+            static const unsigned int kWidth = 4;
+
+            static Vec set1(Real x) { return _mm256_set1_pd(x); }
+            static Vec load(const double *p) { return _mm256_loadu_pd(p); }
+            static Vec load(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+            static void store(Real *p, Vec v) { _mm256_storeu_pd(p, v); }
+            static Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+            static Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+            static Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+            static Vec max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+            static Vec sqrt(Vec a) { return _mm256_sqrt_pd(a); }
+            static Mask greater(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+            static Mask greaterOrEqual(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+            static Mask logicalAnd(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+            static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_pd(b, a, m); }
+        };
+    }
+
+    namespace SpheresKernels
+    {
+        bool intersectAvx2(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                           const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            return intersectSpheresBatch<Avx2Vectors>(nodes, firstIdx, count, ray, t, hitIdx);
+        }
+    }
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#else
+
+namespace MyRaytracer
+{
+    namespace SpheresKernels
+    {
+        bool intersectAvx2(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                           const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            return intersectScalar(nodes, firstIdx, count, ray, t, hitIdx);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,80 @@
+// AVX-512 version of the sphere kernels. Only the code in this file is compiled for AVX-512,
+// it is called only after checking that the CPU supports it.
+
+#include <algorithm>
+#include <limits>
+
+#include "scenedata.h"
+#include "spherekernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHEREFLAKE_HAS_AVX512_KERNEL
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+
+#include <immintrin.h>
+#include "spherekernels_impl.h"
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        struct Avx512Vectors
+        {
+            typedef double Real;
+            typedef __m512d Vec;
+            typedef __mmask8 Mask;
+            static const unsigned int kWidth = 8;
+
+            static Vec set1(Real x) { return _mm512_set1_pd(x); }
+            static Vec load(const double *p) { return _mm512_loadu_pd(p); }
+            static Vec load(const float *p) { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+            static void store(Real *p, Vec v) { _mm512_storeu_pd(p, v); }
+            static Vec add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+            static Vec sub(Vec a, Vec b) { return _mm512_sub_pd(a, b); }
+            static Vec mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+            static Vec max(Vec a, Vec b) { return _mm512_max_pd(a, b); }
+            static Vec sqrt(Vec a) { return _mm512_sqrt_pd(a); }
+            static Mask greater(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+            static Mask greaterOrEqual(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+            static Mask logicalAnd(Mask a, Mask b) { return (Mask)(a & b); }
+            static Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_pd(m, b, a); }
+        };
+    }
+
+    namespace SpheresKernels
+    {
+        bool intersectAvx512(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                           const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            return intersectSpheresBatch<Avx512Vectors>(nodes, firstIdx, count, ray, t, hitIdx);
+        }
+    }
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#else
+
+namespace MyRaytracer
+{
+    namespace SpheresKernels
+    {
+        bool intersectAvx512(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                           const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            return intersectScalar(nodes, firstIdx, count, ray, t, hitIdx);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef SPHEREKERNELS_IMPL_H
+#define SPHEREKERNELS_IMPL_H
+
+// The generic part of the SIMD sphere kernels. It is included by the translation unit
+// of every instruction set after it has switched the compiler to that instruction set,
+// so it has to stay free of anything that is not a template.
+
+#include <algorithm>
+#include <limits>
+
+#include "spherekernels.h"
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        // V describes the vector registers of an instruction set - the Vec and Mask types,
+        // how many doubles fit in a register (kWidth) and the few operations the kernel needs.
+        // The spheres stored in single precision are widened to double when they are loaded,
+        // so the math is the same as in Sphere::intersects whatever the storage.
+        template <typename V>
+        bool intersectSpheresBatch(const BVHNodes &nodes, SphereIndex firstIdx, unsigned int count,
+                                   const Ray &ray, double &t, SphereIndex &hitIdx)
+        {
+            typedef typename V::Real Real;
+            typedef typename V::Vec Vec;
+            typedef typename V::Mask Mask;
+
+            const Vec originX = V::set1((Real)ray.origin.x);
+            const Vec originY = V::set1((Real)ray.origin.y);
+            const Vec originZ = V::set1((Real)ray.origin.z);
+            const Vec directionX = V::set1((Real)ray.direction.x);
+            const Vec directionY = V::set1((Real)ray.direction.y);
+            const Vec directionZ = V::set1((Real)ray.direction.z);
+            const Vec zero = V::set1(0);
+            const Vec noHit = V::set1(std::numeric_limits<Real>::infinity());
+
+            bool hitFound = false;
+
+            // The last batch might not fill a whole register, it is copied here first
+            // so that we never read past the arrays
+            Real tailCenterX[V::kWidth], tailCenterY[V::kWidth], tailCenterZ[V::kWidth], tailRadius[V::kWidth];
+            Real lanes_t[V::kWidth];
+
+            for (unsigned int batchIdx = 0; batchIdx < count; batchIdx += V::kWidth) {
+                SphereIndex nodeIdx = firstIdx + batchIdx;
+                // Not std::min, it would take kWidth by reference and that needs a definition of it
+                unsigned int lanesCount = (count - batchIdx < V::kWidth) ? count - batchIdx : V::kWidth;
+
+                Vec centerX, centerY, centerZ, radius;
+                if (lanesCount == V::kWidth) {
+                    centerX = V::load(nodes.centerX + nodeIdx);
+                    centerY = V::load(nodes.centerY + nodeIdx);
+                    centerZ = V::load(nodes.centerZ + nodeIdx);
+                    radius = V::load(nodes.radius + nodeIdx);
+                } else {
+                    for (unsigned int lane = 0; lane < V::kWidth; lane++) {
+                        SphereIndex srcIdx = nodeIdx + std::min(lane, lanesCount - 1);
+                        tailCenterX[lane] = nodes.centerX[srcIdx];
+                        tailCenterY[lane] = nodes.centerY[srcIdx];
+                        tailCenterZ[lane] = nodes.centerZ[srcIdx];
+                        tailRadius[lane] = nodes.radius[srcIdx];
+                    }
+                    centerX = V::load(tailCenterX);
+                    centerY = V::load(tailCenterY);
+                    centerZ = V::load(tailCenterZ);
+                    radius = V::load(tailRadius);
+                }
+
+                // Same math as Sphere::intersects, but c is computed from the distance between
+                // the center and the ray. It doesn't lose precision for small spheres far from the origin.
+                Vec dstX = V::sub(centerX, originX);
+                Vec dstY = V::sub(centerY, originY);
+                Vec dstZ = V::sub(centerZ, originZ);
+                Vec b = V::add(V::add(V::mul(dstX, directionX), V::mul(dstY, directionY)), V::mul(dstZ, directionZ));
+
+                Vec perpendicularX = V::sub(dstX, V::mul(b, directionX));
+                Vec perpendicularY = V::sub(dstY, V::mul(b, directionY));
+                Vec perpendicularZ = V::sub(dstZ, V::mul(b, directionZ));
+                Vec c = V::sub(V::mul(radius, radius),
+                               V::add(V::add(V::mul(perpendicularX, perpendicularX), V::mul(perpendicularY, perpendicularY)),
+                                      V::mul(perpendicularZ, perpendicularZ)));
+
+                Vec d = V::sqrt(V::max(c, zero));
+                Vec e = V::add(b, d);
+                Vec f = V::sub(b, d);
+                Vec lane_t = V::select(V::greater(f, zero), f, e);
+
+                Mask hit = V::logicalAnd(V::greaterOrEqual(c, zero), V::greaterOrEqual(e, zero));
+                V::store(lanes_t, V::select(hit, lane_t, noHit));
+
+                // Scanning the lanes in order keeps the first sphere when two of them are equally close
+                for (unsigned int lane = 0; lane < lanesCount; lane++) {
+                    if (lanes_t[lane] < t) {
+                        t = lanes_t[lane];
+                        hitIdx = nodeIdx + lane;
+                        hitFound = true;
+                    }
+                }
+            }
+
+            return hitFound;
+        }
+    }
+}
+
+#endif //SPHEREKERNELS_IMPL_H
@@ -0,0 +1,132 @@
+#include "threadpool.h"
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        // Lets a worker find out which pool and which queue it belongs to
+        thread_local const ThreadPool *tCurrentPool = nullptr;
+        thread_local unsigned int tCurrentWorkerIdx = 0;
+    }
+
+    ThreadPool::ThreadPool(unsigned int threadsCount) :
+        pendingJobs_(0),
+        stopping_(false),
+        nextQueueIdx_(0)
+    {
+        if (threadsCount == 0)
+            threadsCount = std::thread::hardware_concurrency();
+        if (threadsCount == 0)
+            threadsCount = 1;
+
+        for (unsigned int workerIdx = 0; workerIdx < threadsCount; workerIdx++)
+            queues_.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue));
+
+        for (unsigned int workerIdx = 0; workerIdx < threadsCount; workerIdx++)
+            workers_.push_back(std::thread(&ThreadPool::workerLoop, this, workerIdx));
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            stopping_ = true;
+        }
+        wakeCondition_.notify_all();
+
+        for (unsigned int workerIdx = 0; workerIdx < workers_.size(); workerIdx++)
+            workers_[workerIdx].join();
+    }
+
+    unsigned int ThreadPool::getCurrentWorkerIndex() const
+    {
+        if (tCurrentPool == this)
+            return tCurrentWorkerIdx;
+        return getThreadsCount();
+    }
+
+    void ThreadPool::submit(const Job &job)
+    {
+        // Workers keep what they produce for themselves (it's most likely still in their cache),
+        // everybody else spreads the jobs evenly
+        unsigned int queueIdx = getCurrentWorkerIndex();
+        if (queueIdx == getThreadsCount())
+            queueIdx = nextQueueIdx_++ % getThreadsCount();
+
+        // The counter goes up before the job becomes visible so that it never underflows
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            pendingJobs_++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues_[queueIdx]->mutex);
+            queues_[queueIdx]->jobs.push_back(job);
+        }
+        wakeCondition_.notify_one();
+    }
+
+    bool ThreadPool::takeJob(unsigned int workerIdx, Job &job)
+    {
+        unsigned int queuesCount = (unsigned int)queues_.size();
+        bool jobFound = false;
+
+        // LIFO from our own queue
+        if (workerIdx < queuesCount) {
+            WorkerQueue &ownQueue = *queues_[workerIdx];
+            std::lock_guard<std::mutex> lock(ownQueue.mutex);
+            if (!ownQueue.jobs.empty()) {
+                job = std::move(ownQueue.jobs.back());
+                ownQueue.jobs.pop_back();
+                jobFound = true;
+            }
+        }
+
+        // FIFO from the others, the oldest jobs are usually the biggest ones
+        for (unsigned int i = 1; !jobFound && i <= queuesCount; i++) {
+            WorkerQueue &victimQueue = *queues_[(workerIdx + i) % queuesCount];
+            std::lock_guard<std::mutex> lock(victimQueue.mutex);
+            if (!victimQueue.jobs.empty()) {
+                job = std::move(victimQueue.jobs.front());
+                victimQueue.jobs.pop_front();
+                jobFound = true;
+            }
+        }
+
+        if (jobFound) {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            pendingJobs_--;
+        }
+
+        return jobFound;
+    }
+
+    bool ThreadPool::runPendingJob()
+    {
+        Job job;
+        if (!takeJob(getCurrentWorkerIndex(), job))
+            return false;
+
+        job();
+        return true;
+    }
+
+    void ThreadPool::workerLoop(unsigned int workerIdx)
+    {
+        tCurrentPool = this;
+        tCurrentWorkerIdx = workerIdx;
+
+        Job job;
+        while (true) {
+            if (takeJob(workerIdx, job)) {
+                job();
+                job = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(wakeMutex_);
+            wakeCondition_.wait(lock, [this] { return stopping_ || pendingJobs_ > 0; });
+            if (stopping_ && pendingJobs_ == 0)
+                return;
+        }
+    }
+}
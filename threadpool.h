@@ -0,0 +1,71 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MyRaytracer
+{
+    // A long-lived pool of worker threads with work stealing.
+    // Every worker owns a deque of jobs. A worker takes jobs from the back of its
+    // own deque and when it runs out of work it steals from the front of the others.
+    // Jobs submitted from outside the pool are distributed round-robin between the workers.
+    // The pool is created once and shared by everybody that needs to run things in parallel.
+    class ThreadPool
+    {
+    public:
+        typedef std::function<void()> Job;
+
+        // Starts threadsCount workers. Zero means one worker per hardware thread.
+        explicit ThreadPool(unsigned int threadsCount = 0);
+        ~ThreadPool();
+
+        unsigned int getThreadsCount() const { return (unsigned int)workers_.size(); }
+
+        // Queues a job to be executed by one of the workers
+        void submit(const Job &job);
+
+        // Executes one pending job on the calling thread.
+        // Returns false if there was nothing to execute.
+        // Threads that wait for their jobs to finish use this to help instead of sleeping.
+        bool runPendingJob();
+
+        // Returns the index of the pool worker running the calling thread
+        // or getThreadsCount() if the caller is not a worker of this pool
+        unsigned int getCurrentWorkerIndex() const;
+
+    private:
+        // Disables copying and assigning
+        ThreadPool &operator=(const ThreadPool &);
+        ThreadPool(const ThreadPool &);
+
+        struct WorkerQueue
+        {
+            std::mutex mutex;
+            std::deque<Job> jobs;
+        };
+
+        void workerLoop(unsigned int workerIdx);
+        // Takes a job from the back of our own queue or steals one from the front of the others
+        bool takeJob(unsigned int workerIdx, Job &job);
+
+        std::vector<std::unique_ptr<WorkerQueue>> queues_;
+        std::vector<std::thread> workers_;
+
+        // Used to put idle workers to sleep
+        std::mutex wakeMutex_;
+        std::condition_variable wakeCondition_;
+        unsigned int pendingJobs_;
+        bool stopping_;
+
+        std::atomic<unsigned int> nextQueueIdx_;
+    };
+}
+
+#endif //THREADPOOL_H
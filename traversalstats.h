@@ -0,0 +1,50 @@
+#ifndef TRAVERSALSTATS_H
+#define TRAVERSALSTATS_H
+
+namespace MyRaytracer
+{
+    // What the traversals did to find the closest hits of some rays
+    struct TraversalStats
+    {
+        TraversalStats() : rays(0), boundTests(0), sphereTests(0), skippedSubtrees(0), hits(0) {}
+
+        void add(const TraversalStats &other)
+        {
+            rays += other.rays;
+            boundTests += other.boundTests;
+            sphereTests += other.sphereTests;
+            skippedSubtrees += other.skippedSubtrees;
+            hits += other.hits;
+        }
+
+        // The counting interface of the traversals
+        void countRay() { rays++; }
+        void countBoundTests(unsigned int count) { boundTests += count; }
+        void countSphereTests(unsigned int count) { sphereTests += count; }
+        void countSkippedSubtrees(unsigned int count) { skippedSubtrees += count; }
+        void countHit() { hits++; }
+
+        unsigned long long rays;
+        // The bounding spheres (or the boxes of the BVHs) tested
+        unsigned long long boundTests;
+        unsigned long long sphereTests;
+        // The subtrees (or BVH nodes) left out because the ray misses their bound or
+        // gets in it only after the closest hit found so far
+        unsigned long long skippedSubtrees;
+        // The sphere tests that found a hit closer than the ones before
+        unsigned long long hits;
+    };
+
+    // The traversals are templates on what they count with. This one counts nothing
+    // and its calls compile to nothing, so the usual traversals don't pay for the statistics.
+    struct NoTraversalStats
+    {
+        void countRay() {}
+        void countBoundTests(unsigned int) {}
+        void countSphereTests(unsigned int) {}
+        void countSkippedSubtrees(unsigned int) {}
+        void countHit() {}
+    };
+}
+
+#endif //TRAVERSALSTATS_H
@@ -0,0 +1,369 @@
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <new>
+
+#include <glm/glm.hpp>
+
+#include "widebvh.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPHEREFLAKE_HAS_SSE2_NODE_TEST
+#include <emmintrin.h>
+#endif
+
+namespace MyRaytracer
+{
+    namespace
+    {
+        // Up to that many spheres are put in a leaf, they are tested with the SIMD spheres kernel
+        const unsigned int kMaxLeafSize = 8;
+
+        // Depth * (Width - 1) + 1 entries are enough, that's plenty for any level we can allocate
+        const unsigned int kMaxStackSize = 256;
+
+        // The boxes are stored in single precision, they are rounded outwards so that they still bound the spheres
+        float roundDown(double value)
+        {
+            float result = (float)value;
+            if (result > value)
+                result = std::nextafter(result, -std::numeric_limits<float>::infinity());
+            return result;
+        }
+
+        float roundUp(double value)
+        {
+            float result = (float)value;
+            if (result < value)
+                result = std::nextafter(result, std::numeric_limits<float>::infinity());
+            return result;
+        }
+
+        struct CenterLess
+        {
+            CenterLess(const BVHNodes &spheres, unsigned int axis) : spheres(spheres), axis(axis) {}
+
+            bool operator()(unsigned int a, unsigned int b) const {
+                const StorageReal *center = (axis == 0) ? spheres.centerX : (axis == 1) ? spheres.centerY : spheres.centerZ;
+                return center[a] < center[b];
+            }
+
+            const BVHNodes &spheres;
+            unsigned int axis;
+        };
+    }
+
+    template <unsigned int Width>
+    bool WideBVH<Width>::build(const BVHNodes &spheres, SphereIndex count)
+    {
+        // The nodes and the leaves index the spheres with 32 bits
+        if (count > std::numeric_limits<unsigned int>::max())
+            return false;
+
+        try {
+            nodes_.clear();
+            order_.resize(count);
+            for (unsigned int sphereIdx = 0; sphereIdx < count; sphereIdx++)
+                order_[sphereIdx] = sphereIdx;
+
+            if (count > 0)
+                buildNode(spheres, 0, count);
+
+            // Copy the spheres in the order of the leaves
+            centerX_.resize(count);
+            centerY_.resize(count);
+            centerZ_.resize(count);
+            radius_.resize(count);
+            for (unsigned int leafIdx = 0; leafIdx < count; leafIdx++) {
+                centerX_[leafIdx] = spheres.centerX[order_[leafIdx]];
+                centerY_[leafIdx] = spheres.centerY[order_[leafIdx]];
+                centerZ_[leafIdx] = spheres.centerZ[order_[leafIdx]];
+                radius_[leafIdx] = spheres.radius[order_[leafIdx]];
+            }
+        } catch (const std::bad_alloc &) {
+            qDebug() << "Failed to allocate memory for a" << Width << "wide BVH";
+            nodes_.clear();
+            return false;
+        }
+
+        leafSpheres_.centerX = centerX_.data();
+        leafSpheres_.centerY = centerY_.data();
+        leafSpheres_.centerZ = centerZ_.data();
+        leafSpheres_.radius = radius_.data();
+
+        qDebug() << "Built a" << Width << "wide BVH with" << nodes_.size() << "nodes";
+
+        return true;
+    }
+
+    template <unsigned int Width>
+    unsigned int WideBVH<Width>::buildNode(const BVHNodes &spheres, unsigned int begin, unsigned int end)
+    {
+        unsigned int nodeIdx = (unsigned int)nodes_.size();
+        nodes_.push_back(Node());
+
+        // Split the spheres in up to Width groups. The biggest group is split in two halves
+        // along the longest axis of its centers until we have enough groups.
+        unsigned int groupBegin[Width], groupEnd[Width];
+        unsigned int groupsCount = 1;
+        groupBegin[0] = begin;
+        groupEnd[0] = end;
+
+        while (groupsCount < Width) {
+            unsigned int biggestGroup = 0;
+            for (unsigned int group = 1; group < groupsCount; group++) {
+                if (groupEnd[group] - groupBegin[group] > groupEnd[biggestGroup] - groupBegin[biggestGroup])
+                    biggestGroup = group;
+            }
+            unsigned int splitBegin = groupBegin[biggestGroup];
+            unsigned int splitEnd = groupEnd[biggestGroup];
+            if (splitEnd - splitBegin <= kMaxLeafSize)
+                break;
+
+            glm::dvec3 minCenter(std::numeric_limits<double>::max());
+            glm::dvec3 maxCenter(-std::numeric_limits<double>::max());
+            for (unsigned int orderIdx = splitBegin; orderIdx < splitEnd; orderIdx++) {
+                unsigned int sphereIdx = order_[orderIdx];
+                glm::dvec3 center(spheres.centerX[sphereIdx], spheres.centerY[sphereIdx], spheres.centerZ[sphereIdx]);
+                minCenter = glm::min(minCenter, center);
+                maxCenter = glm::max(maxCenter, center);
+            }
+            glm::dvec3 extent = maxCenter - minCenter;
+            unsigned int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+
+            unsigned int splitMiddle = splitBegin + (splitEnd - splitBegin) / 2;
+            std::nth_element(order_.begin() + splitBegin, order_.begin() + splitMiddle, order_.begin() + splitEnd,
+                             CenterLess(spheres, axis));
+
+            groupEnd[biggestGroup] = splitMiddle;
+            groupBegin[groupsCount] = splitMiddle;
+            groupEnd[groupsCount] = splitEnd;
+            groupsCount++;
+        }
+
+        // The children are built first, nodes_ might be reallocated meanwhile
+        Node node;
+        for (unsigned int lane = 0; lane < Width; lane++) {
+            if (lane >= groupsCount) {
+                // A box at infinity, nothing can hit it. An inverted box wouldn't work -
+                // the slab test takes the min and max of its sides and turns it into an infinite one.
+                node.minX[lane] = node.minY[lane] = node.minZ[lane] = std::numeric_limits<float>::infinity();
+                node.maxX[lane] = node.maxY[lane] = node.maxZ[lane] = std::numeric_limits<float>::infinity();
+                node.child[lane] = 0;
+                node.leafSize[lane] = 0;
+                continue;
+            }
+
+            glm::dvec3 minCorner(std::numeric_limits<double>::max());
+            glm::dvec3 maxCorner(-std::numeric_limits<double>::max());
+            for (unsigned int orderIdx = groupBegin[lane]; orderIdx < groupEnd[lane]; orderIdx++) {
+                unsigned int sphereIdx = order_[orderIdx];
+                glm::dvec3 center(spheres.centerX[sphereIdx], spheres.centerY[sphereIdx], spheres.centerZ[sphereIdx]);
+                minCorner = glm::min(minCorner, center - glm::dvec3(spheres.radius[sphereIdx]));
+                maxCorner = glm::max(maxCorner, center + glm::dvec3(spheres.radius[sphereIdx]));
+            }
+            node.minX[lane] = roundDown(minCorner.x);
+            node.minY[lane] = roundDown(minCorner.y);
+            node.minZ[lane] = roundDown(minCorner.z);
+            node.maxX[lane] = roundUp(maxCorner.x);
+            node.maxY[lane] = roundUp(maxCorner.y);
+            node.maxZ[lane] = roundUp(maxCorner.z);
+
+            unsigned int groupSize = groupEnd[lane] - groupBegin[lane];
+            if (groupSize <= kMaxLeafSize) {
+                node.child[lane] = groupBegin[lane];
+                node.leafSize[lane] = groupSize;
+            } else {
+                node.child[lane] = buildNode(spheres, groupBegin[lane], groupEnd[lane]);
+                node.leafSize[lane] = 0;
+            }
+        }
+        nodes_[nodeIdx] = node;
+
+        return nodeIdx;
+    }
+
+    template <unsigned int Width>
+    unsigned int WideBVH<Width>::intersectChildren(const Node &node, const float *origin, const float *inverseDirection,
+                                                   float maxT, float *entry_t) const
+    {
+        unsigned int hitMask = 0;
+
+#ifdef SPHEREFLAKE_HAS_SSE2_NODE_TEST
+        const __m128 originX = _mm_set1_ps(origin[0]);
+        const __m128 originY = _mm_set1_ps(origin[1]);
+        const __m128 originZ = _mm_set1_ps(origin[2]);
+        const __m128 inverseDirectionX = _mm_set1_ps(inverseDirection[0]);
+        const __m128 inverseDirectionY = _mm_set1_ps(inverseDirection[1]);
+        const __m128 inverseDirectionZ = _mm_set1_ps(inverseDirection[2]);
+        const __m128 minT = _mm_setzero_ps();
+        const __m128 maxTs = _mm_set1_ps(maxT);
+
+        // Slab test of 4 boxes at a time
+        for (unsigned int lane = 0; lane < Width; lane += 4) {
+            __m128 nearX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX + lane), originX), inverseDirectionX);
+            __m128 farX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX + lane), originX), inverseDirectionX);
+            __m128 nearY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY + lane), originY), inverseDirectionY);
+            __m128 farY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY + lane), originY), inverseDirectionY);
+            __m128 nearZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ + lane), originZ), inverseDirectionZ);
+            __m128 farZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ + lane), originZ), inverseDirectionZ);
+
+            __m128 entry = _mm_max_ps(_mm_max_ps(_mm_min_ps(nearX, farX), _mm_min_ps(nearY, farY)),
+                                      _mm_max_ps(_mm_min_ps(nearZ, farZ), minT));
+            __m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(nearX, farX), _mm_max_ps(nearY, farY)),
+                                     _mm_min_ps(_mm_max_ps(nearZ, farZ), maxTs));
+
+            _mm_storeu_ps(entry_t + lane, entry);
+            hitMask |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(entry, exit)) << lane;
+        }
+#else
+        for (unsigned int lane = 0; lane < Width; lane++) {
+            float nearX = (node.minX[lane] - origin[0]) * inverseDirection[0];
+            float farX = (node.maxX[lane] - origin[0]) * inverseDirection[0];
+            float nearY = (node.minY[lane] - origin[1]) * inverseDirection[1];
+            float farY = (node.maxY[lane] - origin[1]) * inverseDirection[1];
+            float nearZ = (node.minZ[lane] - origin[2]) * inverseDirection[2];
+            float farZ = (node.maxZ[lane] - origin[2]) * inverseDirection[2];
+
+            float entry = std::max(std::max(std::min(nearX, farX), std::min(nearY, farY)), std::max(std::min(nearZ, farZ), 0.0f));
+            float exit = std::min(std::min(std::max(nearX, farX), std::max(nearY, farY)), std::min(std::max(nearZ, farZ), maxT));
+
+            entry_t[lane] = entry;
+            if (entry <= exit)
+                hitMask |= 1u << lane;
+        }
+#endif
+
+        return hitMask;
+    }
+
+    template <unsigned int Width>
+    template <class Stats>
+    bool WideBVH<Width>::intersect(const Ray &ray, SpheresBatchIntersectFunc spheresBatchIntersect,
+                                   double &t, SphereIndex &sphereIdx, Stats &stats) const
+    {
+        if (nodes_.empty())
+            return false;
+
+        const float origin[3] = { (float)ray.origin.x, (float)ray.origin.y, (float)ray.origin.z };
+        const float inverseDirection[3] = { 1.0f / (float)ray.direction.x, 1.0f / (float)ray.direction.y, 1.0f / (float)ray.direction.z };
+
+        struct StackEntry
+        {
+            unsigned int nodeIdx;
+            float entry_t;
+        } stack[kMaxStackSize];
+        unsigned int stackSize = 0;
+
+        stack[stackSize].nodeIdx = 0;
+        stack[stackSize].entry_t = 0;
+        stackSize++;
+
+        // The hit is tracked by its place in the leaves, it's turned into a tree index at the end
+        bool hitFound = false;
+        SphereIndex leafHitIdx;
+        float entry_t[Width];
+
+        while (stackSize > 0) {
+            StackEntry entry = stack[--stackSize];
+            // Something closer was found after the node was pushed
+            if (entry.entry_t > t) {
+                stats.countSkippedSubtrees(1);
+                continue;
+            }
+
+            const Node &node = nodes_[entry.nodeIdx];
+            // Rounded up like in occluded, so that no box with a hit closer than t is cut off
+            float maxT = (t < std::numeric_limits<float>::max()) ? roundUp(t) : std::numeric_limits<float>::max();
+            unsigned int hitMask = intersectChildren(node, origin, inverseDirection, maxT, entry_t);
+            stats.countBoundTests(Width);
+
+            // The leaves are tested right away, the inner nodes are pushed the farthest first
+            // so that the closest one is visited next
+            unsigned int firstPushed = stackSize;
+            for (unsigned int lane = 0; lane < Width; lane++) {
+                if (!((hitMask >> lane) & 1)) {
+                    // The empty lanes (at child 0, the root) are not subtrees
+                    if (node.child[lane] != 0 || node.leafSize[lane] > 0)
+                        stats.countSkippedSubtrees(1);
+                    continue;
+                }
+
+                if (node.leafSize[lane] > 0) {
+                    stats.countSphereTests(node.leafSize[lane]);
+                    if (spheresBatchIntersect(leafSpheres_, node.child[lane], node.leafSize[lane], ray, t, leafHitIdx)) {
+                        stats.countHit();
+                        hitFound = true;
+                    }
+                } else {
+                    unsigned int insertAt = stackSize++;
+                    while (insertAt > firstPushed && stack[insertAt - 1].entry_t < entry_t[lane]) {
+                        stack[insertAt] = stack[insertAt - 1];
+                        insertAt--;
+                    }
+                    stack[insertAt].nodeIdx = node.child[lane];
+                    stack[insertAt].entry_t = entry_t[lane];
+                }
+            }
+        }
+
+        if (hitFound)
+            sphereIdx = order_[leafHitIdx];
+
+        return hitFound;
+    }
+
+    template <unsigned int Width>
+    bool WideBVH<Width>::occluded(const Ray &ray, SpheresBatchIntersectFunc spheresBatchIntersect, double maxT) const
+    {
+        if (nodes_.empty())
+            return false;
+
+        const float origin[3] = { (float)ray.origin.x, (float)ray.origin.y, (float)ray.origin.z };
+        const float inverseDirection[3] = { 1.0f / (float)ray.direction.x, 1.0f / (float)ray.direction.y, 1.0f / (float)ray.direction.z };
+        // Rounded up, so that the boxes are never cut off too early
+        const float boxMaxT = (maxT < std::numeric_limits<float>::max()) ? roundUp(maxT) : std::numeric_limits<float>::max();
+
+        // Any hit will do, so the nodes are visited in whatever order they come
+        unsigned int stack[kMaxStackSize];
+        unsigned int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        SphereIndex leafHitIdx;
+        float entry_t[Width];
+
+        while (stackSize > 0) {
+            const Node &node = nodes_[stack[--stackSize]];
+            unsigned int hitMask = intersectChildren(node, origin, inverseDirection, boxMaxT, entry_t);
+
+            for (unsigned int lane = 0; lane < Width; lane++) {
+                if (!((hitMask >> lane) & 1))
+                    continue;
+
+                if (node.leafSize[lane] > 0) {
+                    double t = maxT;
+                    if (spheresBatchIntersect(leafSpheres_, node.child[lane], node.leafSize[lane], ray, t, leafHitIdx))
+                        return true;
+                } else {
+                    stack[stackSize++] = node.child[lane];
+                }
+            }
+        }
+
+        return false;
+    }
+
+    template class WideBVH<4>;
+    template class WideBVH<8>;
+
+    template bool WideBVH<4>::intersect(const Ray &, SpheresBatchIntersectFunc, double &, SphereIndex &,
+                                        NoTraversalStats &) const;
+    template bool WideBVH<4>::intersect(const Ray &, SpheresBatchIntersectFunc, double &, SphereIndex &,
+                                        TraversalStats &) const;
+    template bool WideBVH<8>::intersect(const Ray &, SpheresBatchIntersectFunc, double &, SphereIndex &,
+                                        NoTraversalStats &) const;
+    template bool WideBVH<8>::intersect(const Ray &, SpheresBatchIntersectFunc, double &, SphereIndex &,
+                                        TraversalStats &) const;
+}
@@ -0,0 +1,68 @@
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <vector>
+
+#include "scenedata.h"
+#include "spherekernels.h"
+
+namespace MyRaytracer
+{
+    // A bounding volume hierarchy built over the spheres of the sphereflake tree where every node has
+    // up to Width children (4 or 8) with tight axis aligned boxes. The boxes of the children of a node
+    // are stored as a structure of arrays, so all of them are tested against a ray at once.
+    // It is an alternative to the skip list traversal of the sphereflake tree itself.
+    template <unsigned int Width>
+    class WideBVH
+    {
+    public:
+        WideBVH() {}
+
+        // Builds the hierarchy over count spheres of the tree. Returns false if we run out of memory.
+        // Up to 2^32 - 1 spheres are supported.
+        bool build(const BVHNodes &spheres, SphereIndex count);
+
+        // Finds the closest sphere hit by the ray that is closer than t.
+        // Updates t and returns the index of the sphere in the tree. Counts what it does with stats.
+        template <class Stats>
+        bool intersect(const Ray &ray, SpheresBatchIntersectFunc spheresBatchIntersect,
+                       double &t, SphereIndex &sphereIdx, Stats &stats) const;
+
+        // Checks if the ray hits any sphere closer than maxT, stops at the first one found
+        bool occluded(const Ray &ray, SpheresBatchIntersectFunc spheresBatchIntersect, double maxT) const;
+
+        size_t getNodesCount() const { return nodes_.size(); }
+
+    private:
+        // Disables copying and assigning
+        WideBVH &operator=(const WideBVH &);
+        WideBVH(const WideBVH &);
+
+        struct Node
+        {
+            float minX[Width], minY[Width], minZ[Width];
+            float maxX[Width], maxY[Width], maxZ[Width];
+            // The index of the child node or of the first sphere of a leaf
+            unsigned int child[Width];
+            // Zero for inner nodes, the number of spheres for leaves
+            unsigned int leafSize[Width];
+        };
+
+        // Builds the node over a range of order_ and returns its index
+        unsigned int buildNode(const BVHNodes &spheres, unsigned int begin, unsigned int end);
+
+        // Tests the ray against the boxes of all the children of a node.
+        // Returns a bit mask of the children hit and their entry distances.
+        unsigned int intersectChildren(const Node &node, const float *origin, const float *inverseDirection,
+                                       float maxT, float *entry_t) const;
+
+        std::vector<Node> nodes_;
+
+        // The spheres in leaf order, so that the spheres of a leaf are next to each other
+        std::vector<unsigned int> order_;
+        std::vector<StorageReal> centerX_, centerY_, centerZ_, radius_;
+        BVHNodes leafSpheres_;
+    };
+}
+
+#endif //WIDEBVH_H